@@ -0,0 +1,178 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+#define CACHE_LOCKS 64
+#define CACHE_WAYS  8
+
+// Only the names' hashes are kept, a 64-bit hash collision within one
+// directory is not a practical concern. Of struct stat only the fields
+// vfat_fill_stat sets are stored.
+struct cache_slot {
+    uint64_t hash;          // of parent and name, 0 marks an empty slot
+    uint32_t parent;
+    uint32_t used;          // tick of the last insert or hit, for LRU
+    uint32_t ino;
+    uint32_t size;
+    uint32_t mode;
+    uint16_t blksize;
+    uint8_t  blocks;
+    uint8_t  prewarm;       // inserted by a walk and not looked up since
+    int64_t  atime, mtime, ctime;
+};
+
+static struct cache_slot *slots;
+static size_t sets;         // power of two, CACHE_WAYS slots each
+static pthread_mutex_t locks[CACHE_LOCKS];
+static uint32_t tick;
+static unsigned long hits, misses;
+
+void vfat_cache_init(size_t entries)
+{
+    size_t n = VFAT_CACHE_SLOTS;
+    int i;
+
+    while (n < entries && 2 * n * sizeof(*slots) <= VFAT_CACHE_BUDGET)
+        n <<= 1;
+    slots = calloc(n, sizeof(*slots));
+    if (slots == NULL)
+        err(1, "cache calloc");
+    sets = n / CACHE_WAYS;
+    for (i = 0; i < CACHE_LOCKS; i++)
+        pthread_mutex_init(&locks[i], NULL);
+}
+
+// FNV-1a over the parent cluster and the name, never returns 0
+static uint64_t cache_hash(uint32_t parent, const char *name)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; i < 4; i++, parent >>= 8) {
+        h ^= parent & 0xFF;
+        h *= 1099511628211ULL;
+    }
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+// Set-associative with LRU inside a set. Walk inserts only replace empty
+// or other walk-inserted slots, so a crawl cannot flush what the user is
+// looking at. The filesystem is read-only, entries are never invalidated.
+static void cache_insert(uint32_t parent, const char *name, const struct stat *st, int prewarm)
+{
+    if (slots == NULL)
+        return;
+
+    uint64_t h = cache_hash(parent, name);
+    size_t set = h & (sets - 1);
+    struct cache_slot *way = &slots[set * CACHE_WAYS], *victim = NULL;
+    pthread_mutex_t *lock = &locks[set % CACHE_LOCKS];
+    uint32_t now = __atomic_add_fetch(&tick, 1, __ATOMIC_RELAXED);
+    int i;
+
+    pthread_mutex_lock(lock);
+    for (i = 0; i < CACHE_WAYS; i++) {
+        struct cache_slot *s = &way[i];
+        if (s->hash == h && s->parent == parent) {
+            victim = s;
+            prewarm &= s->prewarm;
+            break;
+        }
+        if (s->hash == 0) {
+            if (victim == NULL || victim->hash != 0)
+                victim = s;
+        } else if (prewarm && !s->prewarm) {
+            continue;
+        } else if (victim == NULL || (victim->hash != 0
+                   && (s->prewarm > victim->prewarm
+                       || (s->prewarm == victim->prewarm && now - s->used > now - victim->used)))) {
+            victim = s;
+        }
+    }
+    if (victim != NULL) {
+        victim->hash = h;
+        victim->parent = parent;
+        victim->used = now;
+        victim->prewarm = prewarm;
+        victim->ino = st->st_ino;
+        victim->size = st->st_size;
+        victim->mode = st->st_mode;
+        victim->blksize = st->st_blksize;
+        victim->blocks = st->st_blocks;
+        victim->atime = st->st_atime;
+        victim->mtime = st->st_mtime;
+        victim->ctime = st->st_ctime;
+    }
+    pthread_mutex_unlock(lock);
+}
+
+void vfat_cache_insert(uint32_t parent, const char *name, const struct stat *st)
+{
+    cache_insert(parent, name, st, 0);
+}
+
+void vfat_cache_prewarm(uint32_t parent, const char *name, const struct stat *st)
+{
+    cache_insert(parent, name, st, 1);
+}
+
+// @returns 1 and fills st on hit, 0 on miss
+int vfat_cache_lookup(uint32_t parent, const char *name, struct stat *st)
+{
+    int found = 0;
+    int i;
+
+    if (slots != NULL) {
+        uint64_t h = cache_hash(parent, name);
+        size_t set = h & (sets - 1);
+        struct cache_slot *way = &slots[set * CACHE_WAYS];
+        pthread_mutex_t *lock = &locks[set % CACHE_LOCKS];
+
+        pthread_mutex_lock(lock);
+        for (i = 0; i < CACHE_WAYS; i++) {
+            struct cache_slot *s = &way[i];
+            if (s->hash == h && s->parent == parent) {
+                s->used = __atomic_add_fetch(&tick, 1, __ATOMIC_RELAXED);
+                s->prewarm = 0;
+                memset(st, 0, sizeof(*st));
+                st->st_ino = s->ino;
+                st->st_size = s->size;
+                st->st_mode = s->mode;
+                st->st_blksize = s->blksize;
+                st->st_blocks = s->blocks;
+                st->st_atime = s->atime;
+                st->st_mtime = s->mtime;
+                st->st_ctime = s->ctime;
+                found = 1;
+                break;
+            }
+        }
+        pthread_mutex_unlock(lock);
+    }
+
+    __atomic_add_fetch(found ? &hits : &misses, 1, __ATOMIC_RELAXED);
+    return found;
+}
+
+unsigned long vfat_cache_hits(void)
+{
+    return __atomic_load_n(&hits, __ATOMIC_RELAXED);
+}
+
+unsigned long vfat_cache_misses(void)
+{
+    return __atomic_load_n(&misses, __ATOMIC_RELAXED);
+}
+
+size_t vfat_cache_slots(void)
+{
+    return sets * CACHE_WAYS;
+}
@@ -0,0 +1,27 @@
+#ifndef H_CACHE
+#define H_CACHE
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define VFAT_CACHE_SLOTS  8192              // minimum size
+#define VFAT_CACHE_BUDGET (16 * 1024 * 1024) // bytes, caps the size
+
+// (parent directory cluster, name) -> struct stat cache, filled by readdir
+// so that the getattr storm following a listing (ls -l) does not walk the
+// directory again. Path resolution looks up one component at a time.
+// Sized once from the number of entries the volume can hold.
+void vfat_cache_init(size_t entries);
+void vfat_cache_insert(uint32_t parent, const char *name, const struct stat *st);
+int vfat_cache_lookup(uint32_t parent, const char *name, struct stat *st);
+
+// Insert from a tree walk (crawler, query), never evicts a foreground entry
+void vfat_cache_prewarm(uint32_t parent, const char *name, const struct stat *st);
+
+// Statistics for debugfs
+unsigned long vfat_cache_hits(void);
+unsigned long vfat_cache_misses(void);
+size_t vfat_cache_slots(void);
+
+#endif
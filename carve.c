@@ -0,0 +1,583 @@
+#define FUSE_USE_VERSION 26
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "owner.h"
+#include "carve.h"
+#include "scheduler.h"
+
+// Bytes read per sequential sweep step, rounded down to whole clusters
+#define CARVE_CHUNK (16 * 1024 * 1024)
+
+// Read errors kept for the status file, later ones are only counted
+#define CARVE_MAX_FAILED 16
+
+#define CARVE_DELETED 0x01
+#define CARVE_ORPHAN  0x02
+#define CARVE_LFN     0x04  // long name recovered and checksum verified
+
+struct carve_entry {
+    uint32_t dir_cluster;   // cluster holding the entry
+    uint32_t slot;          // entry index within that cluster
+    uint32_t first_cluster;
+    uint32_t size;
+    uint8_t  attr;
+    uint8_t  flags;
+    char*    name;
+};
+
+// A chunk of the data region on its way from the reader to the classifier
+struct carve_buf {
+    char*    mem;       // aligned for O_DIRECT
+    char*    data;      // first cluster within mem
+    uint32_t first;     // first cluster in data
+    uint32_t count;     // 0 marks the end of the sweep
+    int      full;
+};
+
+static struct {
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    int                 started;
+    int                 done;
+    struct carve_buf    bufs[2];
+    uint32_t            scanned;    // clusters classified
+    uint32_t            dirs;       // clusters that looked like directories
+    uint32_t            orphans;    // of those, not linked from the tree
+    struct timespec     begin;
+    double              seconds;
+    struct carve_entry* entries;
+    size_t              nentries;
+    size_t              cap;
+    int                 fd;         // the sweep reads around the page cache
+    size_t              align;
+    uint32_t            errors;
+    struct {
+        off_t offs;
+        size_t len;
+        int   error;
+    }                   failed[CARVE_MAX_FAILED];
+} carve = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* one 32-byte directory slot as a vector, see carve_slot_valid() */
+typedef uint8_t carve_vec __attribute__((vector_size(32)));
+
+/* lane bounds for a short entry: printable 8.3 name, attr without the reserved bits */
+static const carve_vec short_lo = {
+    0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00,
+};
+static const carve_vec short_hi = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3f,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+/* lane bounds for an LFN entry: attr 0x0f, type 0, first cluster 0 */
+static const carve_vec lfn_lo = {
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0f,
+};
+static const carve_vec lfn_hi = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x0f,
+    0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff,
+};
+
+static int carve_all_lanes(const carve_vec *m)
+{
+    uint64_t w[4];
+    memcpy(w, m, sizeof(w));
+    return (w[0] & w[1] & w[2] & w[3]) == UINT64_MAX;
+}
+
+/* a slot holding a plausible short or LFN entry, checked lane-parallel */
+static int carve_slot_valid(const char *slot)
+{
+    carve_vec v, is_short, is_lfn;
+    memcpy(&v, slot, sizeof(v));
+    is_short = (carve_vec) ((v >= short_lo) & (v <= short_hi));
+    is_lfn = (carve_vec) ((v >= lfn_lo) & (v <= lfn_hi));
+    return carve_all_lanes(&is_short) || carve_all_lanes(&is_lfn);
+}
+
+/**
+ * Does the cluster look like an array of fat32_direntry?
+ * All slots up to the end marker must be plausible and at least one must be
+ * a short entry. Data clusters are normally rejected by their first slot.
+*/
+static int carve_is_directory(const char *cluster)
+{
+    size_t i;
+    int shorts = 0;
+
+    for (i = 0; i < vfat_info.direntry_per_cluster; i++) {
+        const char *slot = cluster + i * sizeof(struct fat32_direntry);
+        if (slot[0] == 0)
+            break;
+        if (!carve_slot_valid(slot))
+            return 0;
+        shorts += slot[11] != VFAT_ATTR_LFN;
+    }
+    return shorts > 0;
+}
+
+static void carve_add(uint32_t dir_cluster, uint32_t slot, const struct fat32_direntry *direntry,
+                      const char *name, int flags)
+{
+    struct carve_entry *e;
+    char *p;
+
+    pthread_mutex_lock(&carve.lock);
+    if (carve.nentries == carve.cap) {
+        carve.cap = carve.cap ? carve.cap * 2 : 256;
+        carve.entries = realloc(carve.entries, carve.cap * sizeof(*carve.entries));
+        if (carve.entries == NULL)
+            err(1, "carve realloc");
+    }
+    e = &carve.entries[carve.nentries];
+    e->dir_cluster = dir_cluster;
+    e->slot = slot;
+    e->first_cluster = (le16toh(direntry->cluster_hi) << 16) | le16toh(direntry->cluster_lo);
+    e->size = le32toh(direntry->size);
+    e->attr = direntry->attr;
+    e->flags = flags;
+    e->name = strdup(name);
+    if (e->name == NULL)
+        err(1, "carve strdup");
+    for (p = e->name; *p; p++)
+        if ((unsigned char) *p < 0x20 || *p == '/')
+            *p = '_';
+    carve.nentries++;
+    pthread_mutex_unlock(&carve.lock);
+}
+
+// The first short name character a long name starting in l is given:
+// leading dots and spaces skipped, uppercased, illegal characters as '_'
+static int carve_short_char(const struct fat32_direntry_long *l)
+{
+    uint16_t units[5];
+    size_t i;
+
+    memcpy(units, (const char *) l + offsetof(struct fat32_direntry_long, name1), sizeof(units));
+    for (i = 0; i < 5; i++) {
+        uint16_t u = le16toh(units[i]);
+        if (u == '.' || u == ' ')
+            continue;
+        if (u == 0 || u == 0xFFFF)
+            return -1;
+        if (u < 0x21 || u > 0x7E || strchr("\"*+,/:;<=>?[\\]|", u))
+            return '_';
+        return toupper(u);
+    }
+    return -1; // too many leading dots and spaces to tell
+}
+
+/**
+ * Rebuilds the name of an entry from the LFN fragments in front of it.
+ * For a deleted entry the first byte of the short name is lost (0xE5), as
+ * are the LFN sequence numbers: the fragments are taken in reverse order.
+ * chkSum is a bijection in that byte, so some value always matches; the
+ * fragments are accepted only if it is the short name character the long
+ * name would have produced. Falls back to the short name.
+*/
+static void carve_name(const char *cluster, size_t slot, const struct fat32_direntry *direntry,
+                       char *name, size_t size, int *flags)
+{
+    uint16_t lfn[13 * 0x14];
+    unsigned char shortname[11];
+    int deleted = *flags & CARVE_DELETED;
+    size_t i, n = 0;
+    int b;
+
+    vfat_short_name(direntry, name);
+    if (deleted)
+        name[0] = '_';
+
+    /* fragments directly in front, the nearest holds the start of the name */
+    for (i = slot; i > 0 && n < 0x14; i--, n++) {
+        const struct fat32_direntry_long *l = (const void *) (cluster + (i - 1) * sizeof(*direntry));
+        if (l->attr != VFAT_ATTR_LFN)
+            break;
+        if (deleted ? l->seq != 0xE5 : (l->seq & VFAT_LFN_SEQ_MASK) != n + 1)
+            break;
+        if (!deleted && (l->seq & VFAT_LFN_SEQ_START)) {
+            n++;
+            break;
+        }
+    }
+    if (n == 0)
+        return;
+
+    const struct fat32_direntry_long *nearest = (const void *) (cluster + (slot - 1) * sizeof(*direntry));
+    memcpy(shortname, direntry->nameext, sizeof(shortname));
+
+    if (deleted) {
+        for (b = 0; b < 256; b++) {
+            shortname[0] = b;
+            if (chkSum(shortname) == nearest->csum)
+                break;
+        }
+        if (b != carve_short_char(nearest))
+            return;
+    } else if (chkSum(shortname) != nearest->csum) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        const char *l = cluster + (slot - 1 - i) * sizeof(*direntry);
+        if (((const struct fat32_direntry_long *) l)->csum != nearest->csum)
+            return;
+        memcpy(lfn + i * 13, l + offsetof(struct fat32_direntry_long, name1), 5 * 2);
+        memcpy(lfn + i * 13 + 5, l + offsetof(struct fat32_direntry_long, name2), 6 * 2);
+        memcpy(lfn + i * 13 + 11, l + offsetof(struct fat32_direntry_long, name3), 2 * 2);
+    }
+    for (i = 0; i < n * 13; i++)
+        lfn[i] = le16toh(lfn[i]);
+
+    vfat_utf16_to_utf8(lfn, n * 13, name, size);
+    *flags |= CARVE_LFN;
+}
+
+// c is 0 for the fixed FAT12/16 root directory, which is always linked
+static void carve_directory(const char *cluster, uint32_t c, size_t count)
+{
+    const char *path;
+    off_t offs;
+    char name[13 * 0x14 * 3 + 1];
+    size_t i;
+    int orphan = c != 0 && !owner_lookup(c, &path, &offs);
+
+    __atomic_add_fetch(&carve.dirs, 1, __ATOMIC_RELAXED);
+    if (orphan)
+        __atomic_add_fetch(&carve.orphans, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < count; i++) {
+        const struct fat32_direntry *direntry = (const void *) (cluster + i * sizeof(*direntry));
+        int flags = orphan ? CARVE_ORPHAN : 0;
+
+        if (direntry->nameext[0] == 0)
+            break;
+        if (direntry->attr == VFAT_ATTR_LFN || (direntry->attr & VFAT_ATTR_INVAL) || direntry->nameext[0] == '.')
+            continue;
+
+        if ((direntry->nameext[0] & 0xFF) == 0xE5)
+            flags |= CARVE_DELETED;
+        else if (!orphan)
+            continue; // live entry of a linked directory, nothing to recover
+
+        carve_name(cluster, i, direntry, name, sizeof(name), &flags);
+        carve_add(c, i, direntry, name, flags);
+    }
+}
+
+// A damaged image should not end the sweep, let alone the mount
+static void carve_failed(off_t offs, size_t len, int error)
+{
+    pthread_mutex_lock(&carve.lock);
+    if (carve.errors < CARVE_MAX_FAILED) {
+        carve.failed[carve.errors].offs = offs;
+        carve.failed[carve.errors].len = len;
+        carve.failed[carve.errors].error = error;
+    }
+    carve.errors++;
+    pthread_mutex_unlock(&carve.lock);
+}
+
+// Fills the two buffers in turn while the classifier works on the other one
+static void* carve_reader(void *unused)
+{
+    uint32_t per_chunk = CARVE_CHUNK / vfat_info.bytes_per_cluster;
+    uint32_t c = 2, end = vfat_info.count_of_cluster + 2;
+    int b = 0;
+
+    if (per_chunk == 0)
+        per_chunk = 1;
+    if (carve.align == 1) // no O_DIRECT, at least read ahead
+        posix_fadvise(carve.fd, vfat_info.cluster_begin_offset, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (;;) {
+        struct carve_buf *buf = &carve.bufs[b];
+
+        pthread_mutex_lock(&carve.lock);
+        while (buf->full)
+            pthread_cond_wait(&carve.cond, &carve.lock);
+        pthread_mutex_unlock(&carve.lock);
+
+        uint32_t count = end - c < per_chunk ? end - c : per_chunk;
+        if (count > 0) {
+            /* widen to the O_DIRECT alignment, the data region need not be aligned */
+            off_t offs = vfat_cluster_offset(c);
+            off_t start = offs & ~(off_t) (carve.align - 1);
+            size_t head = offs - start;
+            size_t len = (head + (size_t) count * vfat_info.bytes_per_cluster + carve.align - 1) & ~(carve.align - 1);
+
+            sched_enter(SCHED_BACKGROUND);
+            ssize_t ret = pread(carve.fd, buf->mem, len, start);
+            sched_leave(SCHED_BACKGROUND);
+            if (ret < 0) {
+                carve_failed(offs, (size_t) count * vfat_info.bytes_per_cluster, errno);
+                c += count;
+                continue; // this buffer is still empty, go on with the next chunk
+            }
+            buf->data = buf->mem + head;
+            count = ret > head ? (ret - head) / vfat_info.bytes_per_cluster : 0; // truncated image
+        }
+        buf->first = c;
+        buf->count = count;
+
+        pthread_mutex_lock(&carve.lock);
+        buf->full = 1;
+        pthread_cond_broadcast(&carve.cond);
+        pthread_mutex_unlock(&carve.lock);
+
+        if (count == 0)
+            return NULL;
+        c += count;
+        b ^= 1;
+    }
+}
+
+static void* carve_worker(void *unused)
+{
+    pthread_t reader;
+    struct timespec now;
+    size_t i;
+    int b = 0;
+
+    /* read around the page cache so the sweep does not push the hot data out */
+    if (vfat_info.odirect) {
+        carve.fd = vfat_info.fd;
+        carve.align = vfat_info.io_align;
+    } else if ((carve.fd = vfat_direct_open(&carve.align)) < 0) {
+        carve.fd = vfat_info.fd; // e.g. tmpfs, no O_DIRECT
+        carve.align = 1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        size_t align = carve.align > 64 ? carve.align : 64;
+        if (posix_memalign((void **) &carve.bufs[i].mem, align,
+                           CARVE_CHUNK + vfat_info.bytes_per_cluster + 2 * align) != 0)
+            err(1, "carve buffer");
+    }
+    if (pthread_create(&reader, NULL, carve_reader, NULL) != 0)
+        err(1, "carve pthread_create");
+
+    /* the FAT12/16 root lives outside the data region */
+    if (vfat_info.root_dir_entries > 0) {
+        size_t len = vfat_info.root_dir_entries * sizeof(struct fat32_direntry);
+        char *root = malloc(len);
+        if (root == NULL)
+            err(1, "carve root buffer");
+        arena_reset();
+        errno = 0;
+        if (vfat_pread(root, len, vfat_info.root_dir_offset) == len)
+            carve_directory(root, 0, vfat_info.root_dir_entries);
+        else
+            carve_failed(vfat_info.root_dir_offset, len, errno ? errno : EIO);
+        free(root);
+    }
+
+    for (;;) {
+        struct carve_buf *buf = &carve.bufs[b];
+
+        pthread_mutex_lock(&carve.lock);
+        while (!buf->full)
+            pthread_cond_wait(&carve.cond, &carve.lock);
+        pthread_mutex_unlock(&carve.lock);
+
+        if (buf->count == 0)
+            break;
+
+        for (i = 0; i < buf->count; i++) {
+            const char *cluster = buf->data + i * vfat_info.bytes_per_cluster;
+            if (carve_is_directory(cluster))
+                carve_directory(cluster, buf->first + i, vfat_info.direntry_per_cluster);
+        }
+        __atomic_add_fetch(&carve.scanned, buf->count, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&carve.lock);
+        buf->full = 0;
+        pthread_cond_broadcast(&carve.cond);
+        pthread_mutex_unlock(&carve.lock);
+        b ^= 1;
+    }
+
+    pthread_join(reader, NULL);
+    for (i = 0; i < 2; i++)
+        free(carve.bufs[i].mem);
+    if (carve.fd != vfat_info.fd)
+        close(carve.fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&carve.lock);
+    carve.seconds = (now.tv_sec - carve.begin.tv_sec) + (now.tv_nsec - carve.begin.tv_nsec) / 1e9;
+    carve.done = 1;
+    pthread_mutex_unlock(&carve.lock);
+    return NULL;
+}
+
+void carve_start(void)
+{
+    pthread_t thread;
+    const char *unused_path;
+    off_t unused_offs;
+
+    pthread_mutex_lock(&carve.lock);
+    if (carve.started) {
+        pthread_mutex_unlock(&carve.lock);
+        return;
+    }
+    carve.started = 1;
+    clock_gettime(CLOCK_MONOTONIC, &carve.begin);
+    pthread_mutex_unlock(&carve.lock);
+
+    // orphan detection needs the owner index, build it before sweeping
+    owner_lookup(0, &unused_path, &unused_offs);
+
+    if (pthread_create(&thread, NULL, carve_worker, NULL) != 0)
+        err(1, "carve pthread_create");
+    pthread_detach(thread);
+}
+
+int carve_status(char *buf, size_t size)
+{
+    struct timespec now;
+    double seconds;
+    uint32_t scanned = __atomic_load_n(&carve.scanned, __ATOMIC_RELAXED);
+    uint32_t i;
+    int len;
+
+    pthread_mutex_lock(&carve.lock);
+    if (carve.done) {
+        seconds = carve.seconds;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = (now.tv_sec - carve.begin.tv_sec) + (now.tv_nsec - carve.begin.tv_nsec) / 1e9;
+    }
+    len = snprintf(buf, size,
+                   "state %s\nscanned %u/%zu\ndirectories %u\norphans %u\nrecovered %zu\nMB/s %.1f\n",
+                   carve.done ? "done" : "scanning", scanned, vfat_info.count_of_cluster,
+                   carve.dirs, carve.orphans, carve.nentries,
+                   seconds > 0 ? scanned * (double) vfat_info.bytes_per_cluster / seconds / 1e6 : 0.0);
+    len += snprintf(buf + len, size - len, "errors %u\n", carve.errors);
+    for (i = 0; i < carve.errors && i < CARVE_MAX_FAILED && len < size; i++)
+        len += snprintf(buf + len, size - len, "failed %lld+%zu %s\n", (long long) carve.failed[i].offs,
+                        carve.failed[i].len, strerror(carve.failed[i].error));
+    pthread_mutex_unlock(&carve.lock);
+    return len < size ? len : size - 1;
+}
+
+char* carve_entries(size_t *len)
+{
+    struct carve_entry *entries;
+    size_t i, n, size = 1;
+    char *buf, *eof;
+
+    // copy the table so the classifier is not held up while we format it,
+    // entries are only ever appended and their names never change
+    pthread_mutex_lock(&carve.lock);
+    n = carve.nentries;
+    entries = malloc(n * sizeof(*entries) + 1);
+    if (entries == NULL)
+        err(1, "carve entries malloc");
+    memcpy(entries, carve.entries, n * sizeof(*entries));
+    pthread_mutex_unlock(&carve.lock);
+
+    for (i = 0; i < n; i++)
+        size += strlen(entries[i].name) + 96;
+    eof = buf = malloc(size);
+    if (buf == NULL)
+        err(1, "carve entries malloc");
+
+    // dir_cluster slot flags attr first_cluster size name
+    for (i = 0; i < n; i++) {
+        const struct carve_entry *e = &entries[i];
+        eof += sprintf(eof, "%u %u %s%s%s 0x%02x %u %u %s\n", e->dir_cluster, e->slot,
+                       (e->flags & CARVE_DELETED) ? "D" : "-",
+                       (e->flags & CARVE_ORPHAN) ? "O" : "-",
+                       (e->flags & CARVE_LFN) ? "L" : "-",
+                       e->attr, e->first_cluster, e->size, e->name);
+    }
+    free(entries);
+
+    *len = eof - buf;
+    return buf;
+}
+
+/* recovered regular files, by the id prefix of their name; copies the entry */
+static int carve_find(const char *name, struct carve_entry *out)
+{
+    unsigned int id;
+    int found = 0;
+
+    if (sscanf(name, "%u_", &id) != 1)
+        return 0;
+
+    pthread_mutex_lock(&carve.lock);
+    if (id < carve.nentries && !(carve.entries[id].attr & VFAT_ATTR_DIR)) {
+        *out = carve.entries[id];
+        found = 1;
+    }
+    pthread_mutex_unlock(&carve.lock);
+    return found;
+}
+
+void carve_list(void *callback_data, fuse_fill_dir_t callback)
+{
+    char name[13 * 0x14 * 3 + 16];
+    size_t i;
+
+    pthread_mutex_lock(&carve.lock);
+    for (i = 0; i < carve.nentries; i++) {
+        if (carve.entries[i].attr & VFAT_ATTR_DIR)
+            continue;
+        snprintf(name, sizeof(name), "%zu_%s", i, carve.entries[i].name);
+        callback(callback_data, name, NULL, 0);
+    }
+    pthread_mutex_unlock(&carve.lock);
+}
+
+int carve_getattr(const char *name, struct stat *st)
+{
+    struct carve_entry e;
+
+    if (!carve_find(name, &e))
+        return -ENOENT;
+    st->st_size = e.size;
+    return 0;
+}
+
+// Deleted files lost their chain, assume they were stored contiguously
+int carve_read(const char *name, char *buf, size_t size, off_t offs)
+{
+    struct carve_entry e;
+    off_t limit;
+
+    if (!carve_find(name, &e) || !vfat_cluster_valid(e.first_cluster))
+        return -ENOENT;
+    if (offs >= e.size)
+        return 0;
+    if (size > e.size - offs)
+        size = e.size - offs;
+
+    limit = (off_t) (vfat_info.count_of_cluster + 2 - e.first_cluster) * vfat_info.bytes_per_cluster;
+    if (offs >= limit)
+        return 0;
+    if (size > limit - offs)
+        size = limit - offs;
+
+    ssize_t ret = vfat_pread(buf, size, vfat_cluster_offset(e.first_cluster) + offs);
+    return ret < 0 ? -EIO : ret;
+}
@@ -0,0 +1,25 @@
+#ifndef H_CARVE
+#define H_CARVE
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+// Sweeps the whole data region for clusters that look like directory
+// entry arrays and recovers deleted entries (with their LFN chains) and
+// the entries of directory clusters no longer linked from the tree.
+// Started in the background on first access to /.debug/recovered.
+void carve_start(void);
+
+// /.debug/recovered/status
+int carve_status(char *buf, size_t size);
+// /.debug/recovered/entries, a malloc'd snapshot
+char* carve_entries(size_t *len);
+
+// Recovered files, named "<id>_<name>"
+void carve_list(void *callback_data, fuse_fill_dir_t callback);
+int carve_getattr(const char *name, struct stat *st);
+int carve_read(const char *name, char *buf, size_t size, off_t offs);
+
+#endif
@@ -0,0 +1,217 @@
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "cache.h"
+#include "crawler.h"
+#include "scheduler.h"
+
+// From linux/ioprio.h, which is not always installed
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_WHO_PROCESS  1
+
+// How long to back off while foreground requests are in flight
+#define CRAWLER_BACKOFF_US  2000
+
+// A directory waiting to be listed
+struct crawl_dir {
+    struct crawl_dir* next;
+    uint32_t          cluster;
+    char              path[];
+};
+
+static struct {
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;
+    struct crawl_dir* head;
+    struct crawl_dir* tail;
+    int               started;
+    int               busy;     // workers listing a directory right now
+    int               done;
+    unsigned long     queued;
+    unsigned long     dirs;
+    unsigned long     entries;
+    unsigned long     pauses;
+    unsigned long     skipped;  // directories already queued, or paths too long
+    unsigned long*    seen;     // bitmap of directory clusters already queued
+} crawler = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Used by crawler_entry() to collect subdirectories of the listed directory
+struct crawl_ctx {
+    const char*       dir;
+    uint32_t          cluster;
+    struct crawl_dir* found;
+    unsigned long     entries;
+};
+
+static struct crawl_dir* crawl_dir_new(const char *dir, const char *name, uint32_t cluster)
+{
+    size_t len = strlen(dir) + strlen(name) + 2;
+    struct crawl_dir* d = malloc(sizeof(*d) + len);
+    if (d == NULL)
+        err(1, "crawler malloc");
+    snprintf(d->path, len, "%s/%s", dir, name);
+    d->cluster = cluster;
+    d->next = NULL;
+    return d;
+}
+
+// A corrupted image can cross-link directories or point an entry at
+// cluster 0 (the root), each directory cluster is only queued once.
+// @returns 1 the first time cluster is seen
+static int crawler_first_visit(uint32_t cluster)
+{
+    const int bits = sizeof(*crawler.seen) * CHAR_BIT;
+    unsigned long bit = 1UL << (cluster % bits);
+
+    if (cluster >= vfat_info.count_of_cluster + 2)
+        return 0;
+    return !(__atomic_fetch_or(&crawler.seen[cluster / bits], bit, __ATOMIC_RELAXED) & bit);
+}
+
+static int crawler_entry(void *data, const char *name, const struct stat *st, off_t offs)
+{
+    struct crawl_ctx *ctx = data;
+    struct crawl_dir *d;
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return 0;
+    if (strlen(ctx->dir) + strlen(name) + 2 > PATH_MAX
+        || (S_ISDIR(st->st_mode) && !crawler_first_visit(st->st_ino))) {
+        __atomic_add_fetch(&crawler.skipped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    d = crawl_dir_new(ctx->dir, name, st->st_ino);
+    vfat_cache_prewarm(ctx->cluster, name, st);
+    ctx->entries++;
+
+    if (S_ISDIR(st->st_mode)) {
+        d->next = ctx->found;
+        ctx->found = d;
+    } else {
+        free(d);
+    }
+    return 0;
+}
+
+static void crawler_lower_priority(void)
+{
+    pid_t tid = syscall(SYS_gettid);
+
+    // Both only affect the calling thread; failures just leave us at normal priority
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    setpriority(PRIO_PROCESS, tid, 19);
+}
+
+static void* crawler_worker(void *unused)
+{
+    crawler_lower_priority();
+
+    pthread_mutex_lock(&crawler.lock);
+    for (;;) {
+        while (crawler.head == NULL && crawler.busy > 0)
+            pthread_cond_wait(&crawler.cond, &crawler.lock);
+        if (crawler.head == NULL)
+            break;
+
+        struct crawl_dir *d = crawler.head;
+        crawler.head = d->next;
+        if (crawler.head == NULL)
+            crawler.tail = NULL;
+        crawler.queued--;
+        crawler.busy++;
+        pthread_mutex_unlock(&crawler.lock);
+
+        while (vfat_foreground_pending()) {
+            __atomic_add_fetch(&crawler.pauses, 1, __ATOMIC_RELAXED);
+            usleep(CRAWLER_BACKOFF_US);
+        }
+
+        struct crawl_ctx ctx = { d->path, d->cluster, NULL, 0 };
+        arena_reset();
+        sched_enter(SCHED_BACKGROUND);
+        vfat_readdir(d->cluster, 0, crawler_entry, &ctx);
+        sched_leave(SCHED_BACKGROUND);
+        free(d);
+
+        pthread_mutex_lock(&crawler.lock);
+        while (ctx.found) {
+            struct crawl_dir *sub = ctx.found;
+            ctx.found = sub->next;
+            sub->next = NULL;
+            if (crawler.tail)
+                crawler.tail->next = sub;
+            else
+                crawler.head = sub;
+            crawler.tail = sub;
+            crawler.queued++;
+        }
+        crawler.busy--;
+        crawler.dirs++;
+        crawler.entries += ctx.entries;
+        pthread_cond_broadcast(&crawler.cond);
+    }
+    crawler.done = 1;
+    pthread_cond_broadcast(&crawler.cond);
+    pthread_mutex_unlock(&crawler.lock);
+    return NULL;
+}
+
+// Must be called after fuse has daemonized, threads do not survive the fork
+void crawler_start(int threads)
+{
+    pthread_t thread;
+    int i;
+
+    pthread_mutex_lock(&crawler.lock);
+    if (crawler.started) {
+        pthread_mutex_unlock(&crawler.lock);
+        return;
+    }
+    crawler.started = 1;
+    crawler.seen = calloc((vfat_info.count_of_cluster + 2) / CHAR_BIT / sizeof(*crawler.seen) + 1,
+                          sizeof(*crawler.seen));
+    if (crawler.seen == NULL)
+        err(1, "crawler calloc");
+    crawler_first_visit(vfat_info.root_inode.st_ino);
+    crawler.head = crawler.tail = crawl_dir_new("", "", vfat_info.root_inode.st_ino);
+    crawler.head->path[0] = '\0'; // root, children become "/name"
+    crawler.queued = 1;
+    pthread_mutex_unlock(&crawler.lock);
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&thread, NULL, crawler_worker, NULL) != 0)
+            err(1, "crawler pthread_create");
+        pthread_detach(thread);
+    }
+}
+
+int crawler_report(char *buf, size_t size)
+{
+    int len;
+
+    pthread_mutex_lock(&crawler.lock);
+    len = snprintf(buf, size, "state %s\ndirs %lu\nentries %lu\nqueued %lu\nbusy %d\npauses %lu\nskipped %lu\n",
+                   !crawler.started ? "off" : crawler.done ? "done" : "running",
+                   crawler.dirs, crawler.entries, crawler.queued, crawler.busy,
+                   __atomic_load_n(&crawler.pauses, __ATOMIC_RELAXED),
+                   __atomic_load_n(&crawler.skipped, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&crawler.lock);
+    return len;
+}
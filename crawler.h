@@ -0,0 +1,15 @@
+#ifndef H_CRAWLER
+#define H_CRAWLER
+
+#include <stddef.h>
+
+#define CRAWLER_THREADS 2
+
+// Background breadth-first walk of the directory tree that fills the
+// attribute cache before clients ask for it. Yields to foreground requests.
+void crawler_start(int threads);
+
+// Progress report for debugfs, returns number of bytes written
+int crawler_report(char *buf, size_t size);
+
+#endif
@@ -1,21 +1,212 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 #include "vfat.h"
 #include "debugfs.h"
+#include "cache.h"
+#include "util.h"
+#include "crawler.h"
+#include "owner.h"
+#include "carve.h"
+#include "query.h"
+#include "scheduler.h"
 
 #define DEBUGFS_MAX_FILE_LEN 1024
 
 #define NEXT_CLUSTER_PATH "/next_cluster"
+#define OWNER_PATH "/owner"
+#define RECOVERED_PATH "/recovered"
+#define QUERY_PATH "/query"
+#define OWNER_BATCH "batch"
 
 #define CONSUME_PREFIX(str, prefix) (strncmp(str, prefix, strlen(prefix)) == 0 ? str += strlen(prefix) ,1: 0)
 
+// Opening, reading or listing these walks the tree, builds the owner
+// index or reads the image. Their getattr is cheap and stays metadata.
+int debugfs_bulk(const char *path)
+{
+    return CONSUME_PREFIX(path, QUERY_PATH "/")
+        || CONSUME_PREFIX(path, OWNER_PATH "/")
+        || CONSUME_PREFIX(path, RECOVERED_PATH);
+}
+
+// The cluster list of the batch file. A path component only fits about
+// 40 clusters, so the list is written instead. It is shared by every open,
+// like a sysfs attribute: echo 2-100 > batch; cat batch
+static struct {
+    pthread_mutex_t lock;
+    char*           spec;
+    size_t          len;
+    unsigned long   generation;     // bumped on every change
+} owner_batch = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// An owner report kept in fi->fh
+struct owner_handle {
+    char*         data;
+    size_t        len;
+    int           error;        // of building the batch report, returned by read
+    int           built;
+    unsigned long generation;   // of the batch list the report was built from
+    off_t         pos;          // batch reads are sequential, see debugfs_batch_read()
+};
+
+// A listing built once per open
+struct debugfs_snapshot {
+    char*  data;
+    size_t len;
+};
+
+// Queries, owner reports and the recovered entries listing are built once
+// per open, reads are served from fi->fh
+int debugfs_fuse_open(const char *path, struct fuse_file_info *fi)
+{
+    fi->direct_io = 1; // we lie about sizes, do not let the page cache cut files short
+    if (CONSUME_PREFIX(path, QUERY_PATH "/")) {
+        struct query_result* result = query_run("/", vfat_info.root_inode.st_ino, path);
+        if (result == NULL) return -EINVAL;
+        fi->fh = (uintptr_t) result;
+    } else if (CONSUME_PREFIX(path, OWNER_PATH "/")) {
+        struct owner_handle* owner = calloc(1, sizeof(*owner));
+        if (owner == NULL) return -ENOMEM;
+        if (strcmp(path, OWNER_BATCH) != 0) {
+            int ret = owner_report(path, &owner->data, &owner->len);
+            if (ret != 0) {
+                free(owner);
+                return ret;
+            }
+        }
+        fi->fh = (uintptr_t) owner;
+    } else if (strcmp(path, RECOVERED_PATH "/entries") == 0) {
+        struct debugfs_snapshot* snap = malloc(sizeof(*snap));
+        if (snap == NULL) return -ENOMEM;
+        carve_start();
+        snap->data = carve_entries(&snap->len);
+        fi->fh = (uintptr_t) snap;
+    }
+    return 0;
+}
+
+int debugfs_fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    if (CONSUME_PREFIX(path, QUERY_PATH "/")) {
+        query_free((struct query_result*) (uintptr_t) fi->fh);
+    } else if (CONSUME_PREFIX(path, OWNER_PATH "/")) {
+        struct owner_handle* owner = (struct owner_handle*) (uintptr_t) fi->fh;
+        if (owner) {
+            free(owner->data);
+            free(owner);
+        }
+    } else if (strcmp(path, RECOVERED_PATH "/entries") == 0) {
+        struct debugfs_snapshot* snap = (struct debugfs_snapshot*) (uintptr_t) fi->fh;
+        if (snap) {
+            free(snap->data);
+            free(snap);
+        }
+    }
+    return 0;
+}
+
+// Only the owner batch file is writable: writes append to its cluster
+// list, whatever the offset
+int debugfs_fuse_write(const char *path, const char *buf, size_t size, off_t offs,
+                       struct fuse_file_info *fi)
+{
+    char* spec;
+
+    if (strcmp(path, OWNER_PATH "/" OWNER_BATCH) != 0)
+        return -EACCES;
+
+    pthread_mutex_lock(&owner_batch.lock);
+    spec = realloc(owner_batch.spec, owner_batch.len + size + 1);
+    if (spec == NULL) {
+        pthread_mutex_unlock(&owner_batch.lock);
+        return -ENOMEM;
+    }
+    memcpy(spec + owner_batch.len, buf, size);
+    owner_batch.spec = spec;
+    owner_batch.len += size;
+    owner_batch.spec[owner_batch.len] = '\0';
+    owner_batch.generation++;
+    pthread_mutex_unlock(&owner_batch.lock);
+    return size;
+}
+
+// O_TRUNC on the batch file starts a new list
+int debugfs_fuse_truncate(const char *path, off_t size)
+{
+    if (strcmp(path, OWNER_PATH "/" OWNER_BATCH) != 0)
+        return -EACCES;
+
+    pthread_mutex_lock(&owner_batch.lock);
+    if (size < owner_batch.len) {
+        owner_batch.len = size;
+        if (owner_batch.spec)
+            owner_batch.spec[size] = '\0';
+        owner_batch.generation++;
+    }
+    pthread_mutex_unlock(&owner_batch.lock);
+    return 0;
+}
+
+// Serves the report of the batch list, rebuilt when the list changed.
+// The position is kept per open and ignores the file offset, which the
+// writes on the same descriptor have moved; a read at offset 0 starts over.
+static int debugfs_batch_read(struct owner_handle *owner, char *buf, size_t size, off_t offs)
+{
+    char* spec = NULL;
+    unsigned long generation;
+    size_t len;
+
+    if (owner == NULL) return -EBADF;
+
+    pthread_mutex_lock(&owner_batch.lock);
+    generation = owner_batch.generation;
+    if ((!owner->built || owner->generation != generation) && owner_batch.len > 0
+        && (spec = strdup(owner_batch.spec)) == NULL) {
+        pthread_mutex_unlock(&owner_batch.lock);
+        return -ENOMEM;
+    }
+    pthread_mutex_unlock(&owner_batch.lock);
+
+    if (!owner->built || owner->generation != generation) {
+        free(owner->data);
+        owner->data = NULL;
+        owner->len = 0;
+        owner->error = spec ? owner_report(spec, &owner->data, &owner->len) : 0;
+        owner->generation = generation;
+        owner->built = 1;
+        owner->pos = 0;
+        free(spec);
+    }
+    if (owner->error != 0)
+        return owner->error;
+
+    if (offs == 0)
+        owner->pos = 0;
+    len = owner->len - owner->pos;
+    if (len > size)
+        len = size;
+    memcpy(buf, owner->data + owner->pos, len);
+    owner->pos += len;
+    return len;
+}
+
 int debugfs_fuse_read(const char *path, char *buf, size_t size, off_t offs,
                       struct fuse_file_info *fi)
 {
     char tmpbuf[DEBUGFS_MAX_FILE_LEN];
+    char* content = tmpbuf; // bulk answers are built in the arena instead
     char* eof = tmpbuf;
+    struct query_result* result = NULL;
+    char* report = NULL;
+    size_t owner_len;
     if (strcmp(path, "/bytes_per_sector")==0) {
         eof += sprintf(eof, "%d", (int) vfat_info.bytes_per_sector);
     } else if (strcmp(path, "/sectors_per_cluster")==0) {
@@ -24,8 +215,24 @@ int debugfs_fuse_read(const char *path, char *buf, size_t size, off_t offs,
         eof += sprintf(eof, "%d", (int) vfat_info.reserved_sectors);
     } else if (strcmp(path, "/fat_begin_offset")==0) {
         eof += sprintf(eof, "%d", (int) vfat_info.fat_begin_offset);
+    } else if (strcmp(path, "/fat_bits")==0) {
+        eof += sprintf(eof, "%d", vfat_info.fat_bits);
     } else if (strcmp(path, "/fat_num_entries")==0) {
         eof += sprintf(eof, "%d", (int) vfat_info.fat_entries);
+    } else if (strcmp(path, "/cache_hits")==0) {
+        eof += sprintf(eof, "%lu", vfat_cache_hits());
+    } else if (strcmp(path, "/cache_misses")==0) {
+        eof += sprintf(eof, "%lu", vfat_cache_misses());
+    } else if (strcmp(path, "/cache_slots")==0) {
+        eof += sprintf(eof, "%zu", vfat_cache_slots());
+    } else if (strcmp(path, "/arena")==0) {
+        unsigned long allocs, heap_allocs, resets;
+        arena_stats(&allocs, &heap_allocs, &resets);
+        eof += sprintf(eof, "allocs %lu\nheap_allocs %lu\nrequests %lu\n", allocs, heap_allocs, resets);
+    } else if (strcmp(path, "/crawler")==0) {
+        eof += crawler_report(eof, sizeof(tmpbuf));
+    } else if (strcmp(path, "/sched")==0) {
+        eof += sched_report(eof, sizeof(tmpbuf));
     } else if (CONSUME_PREFIX(path, NEXT_CLUSTER_PATH "/")) {
       unsigned int i;
       if (sscanf(path, "%u", &i) == 1) {
@@ -33,19 +240,63 @@ int debugfs_fuse_read(const char *path, char *buf, size_t size, off_t offs,
       } else {
         eof += sprintf(eof, "ERROR: Could not parse integer from %s", path);
       }
+    } else if (CONSUME_PREFIX(path, OWNER_PATH "/")) {
+      struct owner_handle* owner = fi ? (struct owner_handle*) (uintptr_t) fi->fh : NULL;
+      if (strcmp(path, OWNER_BATCH) == 0)
+        return debugfs_batch_read(owner, buf, size, offs);
+      if (owner) {
+        content = owner->data;
+        eof = content + owner->len;
+      } else if (owner_report(path, &report, &owner_len) == 0) {
+        content = report; // no handle to keep it in, freed below
+        eof = content + owner_len;
+      } else {
+        eof += sprintf(eof, "ERROR: Could not parse cluster list from %s", path);
+      }
+    } else if (strcmp(path, RECOVERED_PATH "/status")==0) {
+      carve_start();
+      eof += carve_status(eof, sizeof(tmpbuf));
+    } else if (strcmp(path, RECOVERED_PATH "/entries")==0) {
+      struct debugfs_snapshot* snap = fi ? (struct debugfs_snapshot*) (uintptr_t) fi->fh : NULL;
+      size_t entries_len;
+      if (snap) {
+        content = snap->data;
+        eof = content + snap->len;
+      } else {
+        carve_start();
+        content = report = carve_entries(&entries_len); // freed below
+        eof = content + entries_len;
+      }
+    } else if (CONSUME_PREFIX(path, QUERY_PATH "/")) {
+      result = (fi && fi->fh) ? (struct query_result*) (uintptr_t) fi->fh
+                              : query_run("/", vfat_info.root_inode.st_ino, path);
+      if (result) {
+        content = result->data;
+        eof = content + result->len;
+      } else {
+        eof += sprintf(eof, "ERROR: Could not parse query %s", path);
+      }
+      if (fi && fi->fh) result = NULL; // freed on release
+    } else if (CONSUME_PREFIX(path, RECOVERED_PATH "/")) {
+      // recovered file contents come straight from the image
+      carve_start();
+      return carve_read(path, buf, size, offs);
     } else {
       eof += sprintf(eof, "Invalid .debugfs request: path '%s'", path);
     }
-    assert(eof >= tmpbuf);
-    int len = (eof - tmpbuf) - offs;
-    if (len < 0) return 0;
+    assert(eof >= content);
+    off_t len = (eof - content) - offs;
+    if (len < 0) len = 0;
     
-    assert(len < 1024);
+    assert(content != tmpbuf || len < DEBUGFS_MAX_FILE_LEN);
     if (len > size) {
       len = size;
     }
 
-    memcpy(buf, tmpbuf+offs, len);
+    if (len > 0)
+      memcpy(buf, content+offs, len);
+    query_free(result);
+    free(report);
     return len;
 }
 
@@ -53,14 +304,35 @@ int debugfs_fuse_readdir(
       const char *path, void *callback_data,
       fuse_fill_dir_t callback, off_t unused_offs, struct fuse_file_info *unused_fi)
 {
+    if (strcmp(path, RECOVERED_PATH) == 0) {
+        carve_start();
+        callback(callback_data, "status", NULL, 0);
+        callback(callback_data, "entries", NULL, 0);
+        carve_list(callback_data, callback);
+        return 0;
+    }
+    if (strcmp(path, OWNER_PATH) == 0) {
+        callback(callback_data, OWNER_BATCH, NULL, 0);
+        return 0;
+    }
     if (strcmp(path, "") != 0) return 0;
     char* listed_files[] = {
         "bytes_per_sector",
         "sectors_per_cluster",
         "reserved_sectors",
         "fat_begin_offset",
+        "fat_bits",
         "fat_num_entries",
+        "cache_hits",
+        "cache_misses",
+        "cache_slots",
+        "arena",
+        "crawler",
+        "sched",
         "next_cluster", // directory
+        "owner", // directory
+        "recovered", // directory
+        "query", // directory
         NULL,
     };
     char** name_ptr = listed_files;
@@ -85,10 +357,17 @@ int debugfs_fuse_getattr(const char *path, struct stat *st) {
     st->st_blocks = 1;
     st->st_mode = S_IRWXU | S_IRWXG | S_IRWXO;
     if (strcmp(path, "") == 0
-        || strcmp(path, NEXT_CLUSTER_PATH) == 0) {
+        || strcmp(path, NEXT_CLUSTER_PATH) == 0
+        || strcmp(path, OWNER_PATH) == 0
+        || strcmp(path, RECOVERED_PATH) == 0
+        || strcmp(path, QUERY_PATH) == 0) {
         st->st_mode |= S_IFDIR; // Directory
     } else {
         st->st_mode |= S_IFREG; // File
     }
+    if (CONSUME_PREFIX(path, RECOVERED_PATH "/")
+        && strcmp(path, "status") != 0 && strcmp(path, "entries") != 0) {
+        return carve_getattr(path, st); // real size of a recovered file
+    }
     return 0; // You can stat anything, viva silent errors ;-)
 }
@@ -3,6 +3,17 @@
 
 #include <fuse.h>
 
+// 1 if serving path costs a tree walk or image reads, see scheduler.h
+int debugfs_bulk(const char *path);
+
+int debugfs_fuse_open(const char *path, struct fuse_file_info *fi);
+int debugfs_fuse_release(const char *path, struct fuse_file_info *fi);
+
+int debugfs_fuse_write(const char *path, const char *buf, size_t size, off_t offs,
+                       struct fuse_file_info *fi);
+
+int debugfs_fuse_truncate(const char *path, off_t size);
+
 int debugfs_fuse_read(const char *path, char *buf, size_t size, off_t offs,
                       struct fuse_file_info *fi);
 
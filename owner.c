@@ -0,0 +1,212 @@
+#define FUSE_USE_VERSION 26
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "owner.h"
+
+// Largest bulk request answered at once
+#define OWNER_MAX_CLUSTERS 65536
+
+// A run of physically contiguous clusters of one chain
+struct owner_extent {
+    uint32_t start;     // first cluster of the run
+    uint32_t count;
+    uint32_t owner;     // index into owners.paths
+    uint32_t index;     // position of start within the chain
+};
+
+static struct {
+    pthread_mutex_t      lock;
+    int                  built;
+    struct owner_extent* extents;
+    size_t               nextents;
+    size_t               cap;
+    char**               paths;
+    size_t               npaths;
+    size_t               path_cap;
+    size_t               max_path;
+} owners = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void* owner_grow(void *array, size_t *cap, size_t elem)
+{
+    *cap = *cap ? *cap * 2 : 1024;
+    array = realloc(array, *cap * elem);
+    if (array == NULL)
+        err(1, "owner index realloc");
+    return array;
+}
+
+static void owner_add_extent(uint32_t start, uint32_t count, uint32_t owner, uint32_t index)
+{
+    if (owners.nextents == owners.cap)
+        owners.extents = owner_grow(owners.extents, &owners.cap, sizeof(*owners.extents));
+    owners.extents[owners.nextents++] = (struct owner_extent) { start, count, owner, index };
+}
+
+// Split the chain starting at first into contiguous runs
+static void owner_add_chain(const char *path, uint32_t first)
+{
+    uint32_t owner, start, count, index = 0;
+    uint32_t cluster = first;
+    size_t limit = vfat_info.count_of_cluster; // guards against looping chains
+
+    if (!vfat_cluster_valid(first))
+        return;
+
+    if (owners.npaths == owners.path_cap)
+        owners.paths = owner_grow(owners.paths, &owners.path_cap, sizeof(*owners.paths));
+    owner = owners.npaths++;
+    owners.paths[owner] = strdup(path);
+    if (strlen(path) > owners.max_path)
+        owners.max_path = strlen(path);
+
+    while (vfat_cluster_valid(cluster) && limit > 0) {
+        start = cluster;
+        count = vfat_chain_run(start, limit, &cluster);
+        owner_add_extent(start, count, owner, index);
+        limit -= count;
+        index += count;
+    }
+}
+
+static int owner_add_entry(void *data, const char *path, const struct stat *st)
+{
+    owner_add_chain(path, st->st_ino);
+    return 0;
+}
+
+static int owner_cmp(const void *a, const void *b)
+{
+    const struct owner_extent *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+static void owner_build(void)
+{
+    struct arena_mark mark;
+
+    arena_save(&mark);
+    owner_add_chain("/", vfat_info.root_inode.st_ino);
+    vfat_walk("/", vfat_info.root_inode.st_ino, owner_add_entry, NULL);
+    arena_release(&mark);
+
+    qsort(owners.extents, owners.nextents, sizeof(*owners.extents), owner_cmp);
+    owners.built = 1;
+}
+
+/**
+ * @returns 1 and the owner of cluster, 0 if no chain in the tree uses it
+*/
+int owner_lookup(uint32_t cluster, const char **path, off_t *offs)
+{
+    size_t lo = 0, hi;
+
+    pthread_mutex_lock(&owners.lock);
+    if (!owners.built)
+        owner_build();
+    pthread_mutex_unlock(&owners.lock);
+
+    // last extent starting at or before cluster
+    hi = owners.nextents;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (owners.extents[mid].start <= cluster)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return 0;
+
+    const struct owner_extent *e = &owners.extents[lo - 1];
+    if (cluster - e->start >= e->count)
+        return 0;
+
+    *path = owners.paths[e->owner];
+    *offs = (off_t) (e->index + cluster - e->start) * vfat_info.bytes_per_cluster;
+    return 1;
+}
+
+static char* owner_line(char *out, uint32_t cluster)
+{
+    const char *path;
+    off_t offs;
+
+    if (owner_lookup(cluster, &path, &offs))
+        return out + sprintf(out, "%u %s %lld\n", cluster, path, (long long) offs);
+    return out + sprintf(out, "%u -\n", cluster);
+}
+
+// Reads the next "<c>" or "<first>-<last>" token of a cluster list
+// @returns 1 on a token, 0 at the end, -1 if spec does not parse
+static int owner_token(const char **spec, unsigned int *first, unsigned int *last)
+{
+    const char *p = *spec;
+    int n;
+
+    while (*p == ',' || isspace((unsigned char) *p))
+        p++;
+    if (*p == '\0')
+        return 0;
+    if (!isdigit((unsigned char) *p) || sscanf(p, "%u%n", first, &n) != 1)
+        return -1;
+    p += n;
+    *last = *first;
+    if (*p == '-') {
+        p++;
+        if (!isdigit((unsigned char) *p) || sscanf(p, "%u%n", last, &n) != 1 || *last < *first)
+            return -1;
+        p += n;
+    }
+    if (*p != '\0' && *p != ',' && !isspace((unsigned char) *p))
+        return -1;
+    *spec = p;
+    return 1;
+}
+
+int owner_report(const char *spec, char **report, size_t *len)
+{
+    unsigned int first, last;
+    size_t count = 0, line;
+    const char *p;
+    char *buf, *eof;
+    int ret;
+
+    for (p = spec; (ret = owner_token(&p, &first, &last)) > 0; ) {
+        count += (size_t) last - first + 1;
+        if (count > OWNER_MAX_CLUSTERS)
+            return -E2BIG;
+    }
+    if (ret < 0 || count == 0)
+        return -EINVAL;
+
+    // make sure the index exists so max_path is known
+    const char *unused_path;
+    off_t unused_offs;
+    owner_lookup(0, &unused_path, &unused_offs);
+
+    line = owners.max_path + 2 * sizeof("4294967295 ") + sizeof("18446744073709551615\n");
+    eof = buf = malloc(count * line + 1);
+    if (buf == NULL)
+        err(1, "owner report malloc");
+
+    for (p = spec; owner_token(&p, &first, &last) > 0; ) {
+        uint64_t c;
+        for (c = first; c <= last; c++)
+            eof = owner_line(eof, c);
+    }
+
+    *report = buf;
+    *len = eof - buf;
+    return 0;
+}
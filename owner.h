@@ -0,0 +1,18 @@
+#ifndef H_OWNER
+#define H_OWNER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Reverse map cluster -> (owning path, byte offset in the file), built
+// lazily from the directory tree and the FAT chains on first use.
+int owner_lookup(uint32_t cluster, const char **path, off_t *offs);
+
+// Formats the answer for a list of "<cluster>" and "<first>-<last>" items,
+// separated by commas or whitespace, one "cluster path offset" line per
+// cluster, into a malloc'd buffer.
+// @returns 0, -EINVAL if spec does not parse, -E2BIG past 65536 clusters
+int owner_report(const char *spec, char **report, size_t *len);
+
+#endif
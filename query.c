@@ -0,0 +1,152 @@
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "query.h"
+
+#define DAY (24 * 60 * 60)
+
+struct query {
+    const char* name;
+    int         name_flags;
+    mode_t      type;       // 0 for any
+    int         size_cmp;   // -1 smaller, 0 exactly, 1 bigger, 2 unused
+    off_t       size;
+    int         mtime_cmp;
+    long        mtime_days;
+    time_t      now;
+    char*       out;
+    size_t      len;
+    size_t      cap;
+};
+
+// "[+-]N" into comparison and number, with an optional size suffix
+static int query_number(const char *s, int *cmp, long long *n, int suffixes)
+{
+    char *end;
+
+    *cmp = (*s == '+') ? 1 : (*s == '-') ? -1 : 0;
+    if (*cmp != 0)
+        s++;
+    *n = strtoll(s, &end, 10);
+    if (end == s)
+        return -1;
+
+    if (suffixes && *end) {
+        switch (*end++) {
+        case 'c': break;
+        case 'k': *n <<= 10; break;
+        case 'M': *n <<= 20; break;
+        case 'G': *n <<= 30; break;
+        default: return -1;
+        }
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+static int query_parse(struct query *q, char *spec)
+{
+    char *term, *save, *value;
+    long long n;
+
+    for (term = strtok_r(spec, "&", &save); term != NULL; term = strtok_r(NULL, "&", &save)) {
+        value = strchr(term, '=');
+        if (value == NULL)
+            return -1;
+        *value++ = '\0';
+
+        if (strcmp(term, "name") == 0 || strcmp(term, "iname") == 0) {
+            q->name = value;
+            q->name_flags = term[0] == 'i' ? FNM_CASEFOLD : 0;
+        } else if (strcmp(term, "type") == 0) {
+            if (strcmp(value, "f") == 0)
+                q->type = S_IFREG;
+            else if (strcmp(value, "d") == 0)
+                q->type = S_IFDIR;
+            else
+                return -1;
+        } else if (strcmp(term, "size") == 0) {
+            if (query_number(value, &q->size_cmp, &n, 1) != 0)
+                return -1;
+            q->size = n;
+        } else if (strcmp(term, "mtime") == 0) {
+            if (query_number(value, &q->mtime_cmp, &n, 0) != 0)
+                return -1;
+            q->mtime_days = n;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int query_cmp(long long value, int cmp, long long limit)
+{
+    return cmp > 0 ? value > limit : cmp < 0 ? value < limit : value == limit;
+}
+
+static int query_match(void *data, const char *path, const struct stat *st)
+{
+    struct query *q = data;
+    const char *base = strrchr(path, '/') + 1;
+    size_t len = strlen(path);
+
+    if (q->type && (st->st_mode & S_IFMT) != q->type)
+        return 0;
+    if (q->name && fnmatch(q->name, base, q->name_flags) != 0)
+        return 0;
+    if (q->size_cmp != 2 && !query_cmp(st->st_size, q->size_cmp, q->size))
+        return 0;
+    if (q->mtime_cmp != 2 && !query_cmp((q->now - st->st_mtime) / DAY, q->mtime_cmp, q->mtime_days))
+        return 0;
+
+    if (q->len + len + 2 > q->cap) {
+        q->cap = (q->cap + len + 2) * 2;
+        q->out = realloc(q->out, q->cap);
+        if (q->out == NULL)
+            err(1, "query realloc");
+    }
+    memcpy(q->out + q->len, path, len);
+    q->out[q->len + len] = '\n';
+    q->len += len + 1;
+    return 0;
+}
+
+struct query_result* query_run(const char *dir, uint32_t cluster, const char *spec)
+{
+    struct query q;
+    struct query_result *result;
+    char *copy = arena_alloc(strlen(spec) + 1, 1);
+
+    memset(&q, 0, sizeof(q));
+    q.size_cmp = q.mtime_cmp = 2;
+    q.now = time(NULL);
+    strcpy(copy, spec);
+    if (query_parse(&q, copy) != 0)
+        return NULL;
+
+    vfat_walk(dir, cluster, query_match, &q);
+
+    result = malloc(sizeof(*result));
+    if (result == NULL)
+        err(1, "query malloc");
+    result->data = q.out;
+    result->len = q.len;
+    return result;
+}
+
+void query_free(struct query_result *result)
+{
+    if (result == NULL)
+        return;
+    free(result->data);
+    free(result);
+}
@@ -0,0 +1,25 @@
+#ifndef H_QUERY
+#define H_QUERY
+
+#include <stddef.h>
+#include <stdint.h>
+
+// find-like search evaluated in a single walk of the tree, so a client
+// does not pay a getattr and a path resolution per entry.
+//
+// spec is a list of terms separated by '&':
+//   name=<glob>    basename matches the fnmatch pattern
+//   iname=<glob>   same, ignoring case
+//   type=f|d       regular files or directories only
+//   size=[+-]N     bigger/smaller than/exactly N bytes, N may end in k, M or G
+//   mtime=[+-]N    modified more/less than/exactly N days ago
+struct query_result {
+    char*  data;    // matching paths, one per line
+    size_t len;
+};
+
+// @returns NULL if spec does not parse
+struct query_result* query_run(const char *dir, uint32_t cluster, const char *spec);
+void query_free(struct query_result *result);
+
+#endif
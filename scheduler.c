@@ -0,0 +1,167 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "scheduler.h"
+
+#define SCHED_BUCKETS 32    // log2 microsecond latency histogram
+
+static const char* class_names[SCHED_CLASSES] = { "meta", "bulk", "background" };
+static const int class_weight[SCHED_CLASSES] = { 8, 2, 1 };
+static const int class_limit[SCHED_CLASSES] = { SCHED_SLOTS, SCHED_SLOTS - 1, 1 };
+
+// A thread waiting for a slot, lives on its stack
+struct sched_waiter {
+    struct sched_waiter* next;
+    pthread_cond_t       cond;
+    int                  granted;
+};
+
+struct sched_queue {
+    struct sched_waiter* head;
+    struct sched_waiter* tail;
+    int                  waiting;
+    int                  running;
+    int                  credit;    // grants left in the current round
+    unsigned long        requests;
+    unsigned long        hist[SCHED_BUCKETS];
+    uint64_t             max_us;
+};
+
+static struct {
+    pthread_mutex_t    lock;
+    int                free;
+    struct sched_queue queues[SCHED_CLASSES];
+} sched = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .free = SCHED_SLOTS,
+};
+
+static __thread struct timespec sched_start;
+
+// Bulk and background together never take the last slot, it stays free
+// for the next metadata call
+static int sched_admissible(enum sched_class cls)
+{
+    return sched.free > (cls == SCHED_META ? 0 : 1) && sched.queues[cls].running < class_limit[cls];
+}
+
+// Hands free slots to waiters, lock held
+static void sched_dispatch(void)
+{
+    int cls, refill;
+
+    while (sched.free > 0) {
+        struct sched_queue *q = NULL;
+
+        for (refill = 0; refill < 2 && q == NULL; refill++) {
+            for (cls = 0; cls < SCHED_CLASSES; cls++) {
+                struct sched_queue *c = &sched.queues[cls];
+                if (c->head && c->credit > 0 && sched_admissible(cls)) {
+                    q = c;
+                    break;
+                }
+            }
+            if (q == NULL) // every class with waiters used up its round
+                for (cls = 0; cls < SCHED_CLASSES; cls++)
+                    sched.queues[cls].credit = class_weight[cls];
+        }
+        if (q == NULL)
+            return;
+
+        struct sched_waiter *w = q->head;
+        q->head = w->next;
+        if (q->head == NULL)
+            q->tail = NULL;
+        q->waiting--;
+        q->running++;
+        q->credit--;
+        sched.free--;
+        w->granted = 1;
+        pthread_cond_signal(&w->cond);
+    }
+}
+
+void sched_enter(enum sched_class cls)
+{
+    struct sched_queue *q = &sched.queues[cls];
+
+    clock_gettime(CLOCK_MONOTONIC, &sched_start);
+
+    pthread_mutex_lock(&sched.lock);
+    if (q->head == NULL && sched_admissible(cls)) {
+        q->running++;
+        sched.free--;
+    } else {
+        struct sched_waiter w = { NULL, PTHREAD_COND_INITIALIZER, 0 };
+        if (q->tail)
+            q->tail->next = &w;
+        else
+            q->head = &w;
+        q->tail = &w;
+        q->waiting++;
+        sched_dispatch();
+        while (!w.granted)
+            pthread_cond_wait(&w.cond, &sched.lock);
+        pthread_cond_destroy(&w.cond);
+    }
+    pthread_mutex_unlock(&sched.lock);
+}
+
+void sched_leave(enum sched_class cls)
+{
+    struct sched_queue *q = &sched.queues[cls];
+    struct timespec now;
+    uint64_t us;
+    int bucket = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - sched_start.tv_sec) * 1000000 + (now.tv_nsec - sched_start.tv_nsec) / 1000;
+    while (bucket < SCHED_BUCKETS - 1 && (us >> bucket) > 0)
+        bucket++;
+
+    pthread_mutex_lock(&sched.lock);
+    q->running--;
+    q->requests++;
+    q->hist[bucket]++;
+    if (us > q->max_us)
+        q->max_us = us;
+    sched.free++;
+    sched_dispatch();
+    pthread_mutex_unlock(&sched.lock);
+}
+
+// Upper bound of the bucket holding the given fraction of requests
+static uint64_t sched_percentile(const struct sched_queue *q, double fraction)
+{
+    unsigned long seen = 0, want = q->requests * fraction;
+    int bucket;
+
+    if (q->requests == 0)
+        return 0;
+    for (bucket = 0; bucket < SCHED_BUCKETS; bucket++) {
+        seen += q->hist[bucket];
+        if (seen > want)
+            break;
+    }
+    return (uint64_t) 1 << bucket;
+}
+
+int sched_report(char *buf, size_t size)
+{
+    int cls, len = 0;
+
+    pthread_mutex_lock(&sched.lock);
+    for (cls = 0; cls < SCHED_CLASSES && len < size; cls++) {
+        const struct sched_queue *q = &sched.queues[cls];
+        len += snprintf(buf + len, size - len,
+                        "%s requests %lu running %d waiting %d p50_us %llu p99_us %llu max_us %llu\n",
+                        class_names[cls], q->requests, q->running, q->waiting,
+                        (unsigned long long) sched_percentile(q, 0.50),
+                        (unsigned long long) sched_percentile(q, 0.99),
+                        (unsigned long long) q->max_us);
+    }
+    pthread_mutex_unlock(&sched.lock);
+    return len;
+}
@@ -0,0 +1,26 @@
+#ifndef H_SCHEDULER
+#define H_SCHEDULER
+
+#include <stddef.h>
+
+// Admission control for the multithreaded FUSE loop. Every request takes
+// one of SCHED_SLOTS slots for its duration; waiters are queued per class
+// and granted slots by weighted round robin. Bulk and background work
+// together can never take the last slot, so metadata calls do not queue
+// behind a big copy or a sweep.
+enum sched_class {
+    SCHED_META,         // getattr, readdir, getxattr, open, debugfs counters
+    SCHED_BULK,         // file data reads, debugfs queries, owner and carve files
+    SCHED_BACKGROUND,   // prewarm crawler, carving sweep
+    SCHED_CLASSES,
+};
+
+#define SCHED_SLOTS 4
+
+void sched_enter(enum sched_class cls);
+void sched_leave(enum sched_class cls);
+
+// Per-class counts and latency percentiles for debugfs
+int sched_report(char *buf, size_t size);
+
+#endif
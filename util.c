@@ -1,6 +1,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include <assert.h>
 #include <sys/mman.h>
 #include <err.h>
@@ -53,3 +55,126 @@ void unmap(void* buf, size_t size)
       err(1, "munmap failed");
 }
 
+
+// Per-thread scratch arena.
+// Every FUSE request starts with arena_reset(); allocations made while the
+// request is served are bump-allocated from the thread's block and dropped
+// all at once. A request that overflows the block chains another one from
+// the heap; the next reset coalesces them into a single block, so a thread
+// stops touching the heap once it has seen its largest request.
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+
+struct arena_block {
+    struct arena_block* next;
+    size_t              size;
+    size_t              used;
+    char                data[];
+};
+
+static __thread struct arena_block* arena_head;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static unsigned long arena_allocs, arena_heap_allocs, arena_resets;
+
+static void arena_free_blocks(void* head)
+{
+    struct arena_block* block = head;
+    while (block) {
+        struct arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+static void arena_make_key(void)
+{
+    // Free the blocks of FUSE worker threads when they exit
+    if (pthread_key_create(&arena_key, arena_free_blocks) != 0)
+        err(1, "pthread_key_create");
+}
+
+static struct arena_block* arena_new_block(size_t size, struct arena_block* next)
+{
+    struct arena_block* block = malloc(sizeof(*block) + size);
+    if (block == NULL)
+        err(1, "arena malloc");
+    block->next = next;
+    block->size = size;
+    block->used = 0;
+    __atomic_add_fetch(&arena_heap_allocs, 1, __ATOMIC_RELAXED);
+
+    pthread_once(&arena_key_once, arena_make_key);
+    pthread_setspecific(arena_key, block);
+    return block;
+}
+
+// align must be a power of two
+void* arena_alloc(size_t size, size_t align)
+{
+    struct arena_block* block = arena_head;
+    uintptr_t p;
+
+    __atomic_add_fetch(&arena_allocs, 1, __ATOMIC_RELAXED);
+    if (block) {
+        p = ((uintptr_t)(block->data + block->used) + align - 1) & ~(uintptr_t)(align - 1);
+        if (p + size <= (uintptr_t)(block->data + block->size)) {
+            block->used = p + size - (uintptr_t)block->data;
+            return (void*)p;
+        }
+    }
+
+    size_t want = size + align;
+    arena_head = block = arena_new_block(want > ARENA_BLOCK_SIZE ? want : ARENA_BLOCK_SIZE, block);
+    p = ((uintptr_t)block->data + align - 1) & ~(uintptr_t)(align - 1);
+    block->used = p + size - (uintptr_t)block->data;
+    return (void*)p;
+}
+
+void arena_reset(void)
+{
+    struct arena_block* block = arena_head;
+
+    __atomic_add_fetch(&arena_resets, 1, __ATOMIC_RELAXED);
+    if (block == NULL)
+        return;
+
+    if (block->next) {
+        size_t total = 0;
+        for (; block; block = block->next)
+            total += block->size;
+        arena_free_blocks(arena_head);
+        arena_head = arena_new_block(total, NULL);
+    } else {
+        block->used = 0;
+    }
+}
+
+// Remember the current top of the arena, see arena_release()
+void arena_save(struct arena_mark* mark)
+{
+    mark->block = arena_head;
+    mark->used = arena_head ? arena_head->used : 0;
+}
+
+// Give back everything allocated since arena_save(), marks nest LIFO.
+// Blocks chained since the mark stay on the list: the top one is rewound
+// and reused, and the next arena_reset() merges the chain so the arena
+// grows to fit. Nothing goes back to the heap here.
+void arena_release(const struct arena_mark* mark)
+{
+    if (arena_head == NULL)
+        return;
+    if (arena_head != mark->block)
+        arena_head->used = 0; // everything in it came after the mark
+    else
+        arena_head->used = mark->used;
+}
+
+void arena_stats(unsigned long* allocs, unsigned long* heap_allocs, unsigned long* resets)
+{
+    *allocs = __atomic_load_n(&arena_allocs, __ATOMIC_RELAXED);
+    *heap_allocs = __atomic_load_n(&arena_heap_allocs, __ATOMIC_RELAXED);
+    *resets = __atomic_load_n(&arena_resets, __ATOMIC_RELAXED);
+}
@@ -1,7 +1,20 @@
 #ifndef H_UTIL
 #define H_UTIL
 
+#include <sys/types.h>
+
 void* mmap_file(int fd, off_t offset, size_t size);
 void unmap(void* buf, size_t size);
 
+struct arena_mark {
+    void*  block;
+    size_t used;
+};
+
+void* arena_alloc(size_t size, size_t align);
+void arena_reset(void);
+void arena_save(struct arena_mark* mark);
+void arena_release(const struct arena_mark* mark);
+void arena_stats(unsigned long* allocs, unsigned long* heap_allocs, unsigned long* resets);
+
 #endif
@@ -3,29 +3,174 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <ctype.h>
 #include <endian.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
 #include <iconv.h>
+#include <limits.h>
+#include <linux/fs.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "vfat.h"
 #include "util.h"
 #include "debugfs.h"
+#include "cache.h"
+#include "crawler.h"
+#include "query.h"
+#include "scheduler.h"
 
 #define DEBUG_PRINT(...) printf(__VA_ARGS)
 #define MAX_NAME_SIZE (13 * 0x14)
+// Longest cluster run vfat_readdir measures ahead, listings often stop early
+#define VFAT_READDIR_RUN 64
 
 iconv_t iconv_utf16;
 char* DEBUGFS_PATH = "/.debug";
+#define QUERY_XATTR "debug.query:"
 
+enum {
+    VFAT_KEY_PREWARM,
+    VFAT_KEY_ODIRECT,
+};
+
+static struct fuse_opt vfat_opts[] = {
+    FUSE_OPT_KEY("prewarm", VFAT_KEY_PREWARM),
+    FUSE_OPT_KEY("odirect", VFAT_KEY_ODIRECT),
+    FUSE_OPT_END
+};
+
+static int vfat_foreground; // FUSE requests in flight
+
+static int vfat_request_begin(enum sched_class cls)
+{
+    arena_reset();
+    __atomic_add_fetch(&vfat_foreground, 1, __ATOMIC_RELAXED);
+    sched_enter(cls);
+    return cls;
+}
+
+static void vfat_request_end(int *cls)
+{
+    sched_leave(*cls);
+    __atomic_sub_fetch(&vfat_foreground, 1, __ATOMIC_RELAXED);
+}
+
+// Admits a FUSE request through the scheduler and marks it as in flight
+// until the enclosing function returns
+#define VFAT_REQUEST(cls) \
+    int vfat_request __attribute__((cleanup(vfat_request_end), unused)) = vfat_request_begin(cls)
+
+// Metadata, unless it is a debugfs request doing bulk work
+static enum sched_class vfat_request_class(const char *path)
+{
+    if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0
+        && debugfs_bulk(path + strlen(DEBUGFS_PATH)))
+        return SCHED_BULK;
+    return SCHED_META;
+}
+
+int vfat_foreground_pending(void)
+{
+    return __atomic_load_n(&vfat_foreground, __ATOMIC_RELAXED) > 0;
+}
+
+
+// Chain walker of one FAT width, see VFAT_FAT_ENGINE
+struct vfat_fat_ops {
+    uint32_t (*run)(uint32_t c, uint32_t max, uint32_t *next);
+    uint32_t (*skip)(uint32_t c, uint32_t n);
+    uint32_t eoc;   // first end-of-chain value
+};
+
+/*
+ * Generates the engine for one FAT width: the entry lookup is inlined into
+ * the chain walking loops, which have no per-step width dispatch. run
+ * measures a run of physically adjacent clusters, so callers pay one
+ * indirect call per fragment. The engine is picked once in vfat_init, so
+ * one binary serves FAT12, FAT16 and FAT32.
+ */
+#define VFAT_FAT_ENGINE(bits, entry, eoc_value)                         \
+    static inline uint32_t vfat_entry##bits(uint32_t c)                 \
+    {                                                                   \
+        return (entry);                                                 \
+    }                                                                   \
+    static uint32_t vfat_run##bits(uint32_t c, uint32_t max, uint32_t *next) \
+    {                                                                   \
+        uint32_t n = 1, e = vfat_entry##bits(c);                        \
+        while (n < max && e == c + n && e - 2 < vfat_info.count_of_cluster) { \
+            e = vfat_entry##bits(e);                                    \
+            n++;                                                        \
+        }                                                               \
+        *next = e;                                                      \
+        return n;                                                       \
+    }                                                                   \
+    static uint32_t vfat_skip##bits(uint32_t c, uint32_t n)             \
+    {                                                                   \
+        for (; n > 0 && c - 2 < vfat_info.count_of_cluster; n--)        \
+            c = vfat_entry##bits(c);                                    \
+        return c;                                                       \
+    }                                                                   \
+    static const struct vfat_fat_ops vfat_fat##bits = {                 \
+        vfat_run##bits, vfat_skip##bits, eoc_value,                     \
+    };
+
+/* 12-bit entries are packed in pairs into 3 bytes, odd ones in the high 12 bits */
+#define VFAT_FAT12_ENTRY(c) \
+    (((((const uint8_t *) vfat_info.fat)[(c) + (c) / 2] \
+       | ((const uint8_t *) vfat_info.fat)[(c) + (c) / 2 + 1] << 8) >> (((c) & 1) << 2)) & 0xFFF)
+
+VFAT_FAT_ENGINE(12, VFAT_FAT12_ENTRY(c), 0xFF8)
+VFAT_FAT_ENGINE(16, le16toh(((const uint16_t *) vfat_info.fat)[c]), 0xFFF8)
+VFAT_FAT_ENGINE(32, le32toh(vfat_info.fat[c]) & 0x0FFFFFFF, 0x0FFFFFF8)
+
+static const struct vfat_fat_ops *vfat_fat = &vfat_fat32;
+
+/**
+ * Opens another descriptor on the image with O_DIRECT
+ * @align set to the alignment its reads need, at least a sector
+ * @returns the descriptor, -1 with errno set on failure
+*/
+int vfat_direct_open(size_t *align)
+{
+    struct stat st;
+    int sector_size;
+
+    if (fstat(vfat_info.fd, &st) < 0)
+        return -1;
+    if (S_ISBLK(st.st_mode) && ioctl(vfat_info.fd, BLKSSZGET, &sector_size) == 0)
+        *align = sector_size;
+    else
+        *align = st.st_blksize; // regular image file, the host filesystem block
+    if (*align < vfat_info.bytes_per_sector)
+        *align = vfat_info.bytes_per_sector;
+    if (*align & (*align - 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return open(vfat_info.dev, O_RDONLY | O_DIRECT);
+}
+
+/* reopen the image with O_DIRECT so blocks are not kept in the page cache as well */
+static void
+vfat_open_direct(const char *dev)
+{
+    int fd = vfat_direct_open(&vfat_info.io_align);
+    if (fd < 0)
+        err(1, "open(%s, O_DIRECT) with alignment %zu", dev, vfat_info.io_align);
+    close(vfat_info.fd);
+    vfat_info.fd = fd;
+}
 
 static void
 vfat_init(const char *dev)
@@ -40,6 +185,7 @@ vfat_init(const char *dev)
     // Use mount time as mtime and ctime for the filesystem root entry (e.g. "/")
     vfat_info.mount_time = time(NULL);
 
+    vfat_info.dev = dev;
     vfat_info.fd = open(dev, O_RDONLY);
     if (vfat_info.fd < 0)
         err(1, "open(%s)", dev);
@@ -53,28 +199,54 @@ vfat_init(const char *dev)
     vfat_info.sectors_per_cluster = s.sectors_per_cluster;
     vfat_info.reserved_sectors = s.reserved_sectors;
     vfat_info.sectors_per_fat = s.sectors_per_fat;
-    vfat_info.fat_entries = s.sectors_per_fat / s.sectors_per_cluster;
     vfat_info.fat_size = (s.sectors_per_fat_small != 0) ? s.sectors_per_fat_small : s.sectors_per_fat;
     vfat_info.total_sector = (s.total_sectors_small != 0) ? s.total_sectors_small : s.total_sectors;
-    vfat_info.count_of_cluster = (vfat_info.total_sector - (vfat_info.reserved_sectors + ( vfat_info.fat_size * s.fat_count))) / vfat_info.sectors_per_cluster;
-    vfat_info.cluster_begin_offset = (vfat_info.reserved_sectors + 2 * vfat_info.fat_size) * vfat_info.bytes_per_sector;
+
+    /* FAT12/16 keep the root directory in a fixed region between the FATs and the data */
+    vfat_info.root_dir_entries = s.root_max_entries;
+    vfat_info.root_dir_offset = (vfat_info.reserved_sectors + s.fat_count * vfat_info.fat_size) * vfat_info.bytes_per_sector;
+    size_t root_dir_sectors = (vfat_info.root_dir_entries * sizeof(struct fat32_direntry) + vfat_info.bytes_per_sector - 1) / vfat_info.bytes_per_sector;
+
+    size_t data_sector = vfat_info.reserved_sectors + s.fat_count * vfat_info.fat_size + root_dir_sectors;
+    vfat_info.count_of_cluster = (vfat_info.total_sector - data_sector) / vfat_info.sectors_per_cluster;
+    vfat_info.cluster_begin_offset = data_sector * vfat_info.bytes_per_sector;
+    vfat_info.direntry_per_cluster = vfat_info.bytes_per_cluster / sizeof(struct fat32_direntry);
+
+    /* every non-empty file or directory owns at least one cluster */
+    vfat_cache_init(vfat_info.count_of_cluster + vfat_info.root_dir_entries);
+
+    /* O_DIRECT: smallest unit the image can be read in, at least a sector (4Kn included) */
+    vfat_info.io_align = vfat_info.bytes_per_sector;
+    if (vfat_info.odirect)
+        vfat_open_direct(dev);
 
     /* fat 12 */
-    if(vfat_info.count_of_cluster < 4085)
-        return;
+    if(vfat_info.count_of_cluster < 4085) {
+        vfat_info.fat_bits = 12;
+        vfat_fat = &vfat_fat12;
+    }
     /* fat 16 */
-    else if(vfat_info.count_of_cluster < 65525)
-        return;
+    else if(vfat_info.count_of_cluster < 65525) {
+        vfat_info.fat_bits = 16;
+        vfat_fat = &vfat_fat16;
+    }
     /* fat 32 */
-    else if(!((s.fat_flags >> 7) & 1))
-        vfat_info.active_fat = (s.fat_flags & 1);
+    else {
+        vfat_info.fat_bits = 32;
+        vfat_fat = &vfat_fat32;
+        vfat_info.root_dir_entries = 0;
+        if(!((s.fat_flags >> 7) & 1))
+            vfat_info.active_fat = (s.fat_flags & 1);
+    }
+    vfat_info.fat_entries = vfat_info.fat_size * vfat_info.bytes_per_sector * 8 / vfat_info.fat_bits;
 
-    /* mapping the fat32 */
-    vfat_info.fat_begin_offset = (vfat_info.reserved_sectors + vfat_info.active_fat * vfat_info.sectors_per_fat) * vfat_info.bytes_per_sector;
-    vfat_info.fat = mmap_file(vfat_info.fd, vfat_info.fat_begin_offset, vfat_info.fat_size);
+    /* mapping the active fat */
+    vfat_info.fat_begin_offset = (vfat_info.reserved_sectors + vfat_info.active_fat * vfat_info.fat_size) * vfat_info.bytes_per_sector;
+    vfat_info.fat = mmap_file(vfat_info.fd, vfat_info.fat_begin_offset, vfat_info.fat_size * vfat_info.bytes_per_sector);
     /* XXX ENd */
 
-    vfat_info.root_inode.st_ino = le32toh(s.root_cluster);
+    /* cluster 0 stands for the fixed FAT12/16 root directory */
+    vfat_info.root_inode.st_ino = (vfat_info.fat_bits == 32) ? le32toh(s.root_cluster) : 0;
     vfat_info.root_inode.st_mode = 0555 | S_IFDIR;
     vfat_info.root_inode.st_nlink = 1;
     vfat_info.root_inode.st_uid = vfat_info.mount_uid;
@@ -99,283 +271,297 @@ chkSum (unsigned char *pFcbName) {
     return (sum);
 }
 
-int vfat_next_cluster(uint32_t c)
+uint32_t vfat_next_cluster(uint32_t c)
+{
+    uint32_t next;
+
+    vfat_chain_run(c, 1, &next);
+    return next;
+}
+
+/**
+ * Measures the run of physically adjacent clusters starting at c
+ * @max longest run to report
+ * @next set to the cluster following the run, end-of-chain past the end
+ * @returns length of the run, 0 if c is not a data cluster
+*/
+uint32_t vfat_chain_run(uint32_t c, uint32_t max, uint32_t *next)
 {
-    /* find next cluster */
-    /* TODO: Read FAT to actually get the next cluster */
-    return vfat_info.fat[c]; // no next cluster
+    if (c - 2 >= vfat_info.count_of_cluster || max == 0) {
+        *next = vfat_fat->eoc; // never index past the mapped FAT
+        return 0;
+    }
+    return vfat_fat->run(c, max, next);
+}
+
+/* follow n links of the chain, stops early at its end */
+uint32_t vfat_chain_skip(uint32_t c, uint32_t n)
+{
+    return vfat_fat->skip(c, n);
+}
+
+/**
+ * pread() from the image that honors the O_DIRECT alignment rules
+ * Unaligned requests are widened to io_align and bounced through the arena.
+ * @returns bytes read, -1 on error
+*/
+ssize_t vfat_pread(void *buf, size_t size, off_t offs)
+{
+    size_t align = vfat_info.io_align;
+
+    if (!vfat_info.odirect || (((uintptr_t) buf | size | offs) & (align - 1)) == 0)
+        return pread(vfat_info.fd, buf, size, offs);
+
+    off_t start = offs & ~(off_t) (align - 1);
+    size_t len = (offs - start + size + align - 1) & ~(align - 1);
+    char *bounce = arena_alloc(len, align);
+
+    ssize_t ret = pread(vfat_info.fd, bounce, len, start);
+    if (ret < 0)
+        return ret;
+    ret -= offs - start;
+    if (ret <= 0)
+        return 0;
+    if (ret > size)
+        ret = size;
+    memcpy(buf, bounce + (offs - start), ret);
+    return ret;
+}
+
+/* a data cluster, as opposed to free/bad/end-of-chain markers of any FAT width */
+int vfat_cluster_valid(uint32_t c)
+{
+    return c - 2 < vfat_info.count_of_cluster;
+}
+
+off_t vfat_cluster_offset(uint32_t c)
+{
+    return vfat_info.cluster_begin_offset + (off_t) (c - 2) * vfat_info.bytes_per_cluster;
+}
+
+/* FAT date and time to time_t */
+static time_t vfat_time(uint16_t date, uint16_t time)
+{
+    struct tm info;
+
+    if (date == 0)
+        return 0;
+
+    memset(&info, 0, sizeof(info));
+    info.tm_year = ((date >> 9) & 0x7F) + 80;
+    info.tm_mon = ((date >> 5) & 0xF) - 1;
+    info.tm_mday = (date & 0x1F);
+
+    info.tm_hour = ((time >> 11) & 0x1F);
+    info.tm_min = ((time >> 5) & 0x3F);
+    info.tm_sec = 2 * (time & 0x1F);
+    info.tm_isdst = -1;
+
+    return mktime(&info);
+}
+
+static void vfat_fill_stat(const struct fat32_direntry *direntry, struct stat *st)
+{
+    st->st_mode = S_IRWXU | S_IRWXG | S_IRWXO;
+    st->st_mode |= (direntry->attr & VFAT_ATTR_DIR) ? S_IFDIR : S_IFREG;
+
+    st->st_size = le32toh(direntry->size);
+
+    st->st_atime = vfat_time(le16toh(direntry->atime_date), 0);
+    st->st_mtime = vfat_time(le16toh(direntry->mtime_date), le16toh(direntry->mtime_time));
+    st->st_ctime = vfat_time(le16toh(direntry->ctime_date), le16toh(direntry->ctime_time));
+
+    st->st_dev = 0;
+    st->st_blocks = 2;
+    st->st_blksize = 4;
+    st->st_ino = (le16toh(direntry->cluster_hi) << 16) | le16toh(direntry->cluster_lo);
+
+    /* ".." of a first level directory points to cluster 0 */
+    if (st->st_ino == 0 && S_ISDIR(st->st_mode))
+        st->st_ino = vfat_info.root_inode.st_ino;
+}
+
+/* 8.3 name to "NAME.EXT", honoring the NT lowercase flags */
+void vfat_short_name(const struct fat32_direntry *direntry, char *name)
+{
+    int i, len = 0;
+    int name_len = 8, ext_len = 3;
+
+    while (name_len > 0 && direntry->name[name_len - 1] == ' ')
+        name_len--;
+    while (ext_len > 0 && direntry->ext[ext_len - 1] == ' ')
+        ext_len--;
+
+    for (i = 0; i < name_len; i++)
+        name[len++] = (direntry->res & 0x08) ? tolower(direntry->name[i]) : direntry->name[i];
+    /* 0x05 stands in for a real 0xE5 lead byte */
+    if (len > 0 && (name[0] & 0xFF) == 0x05)
+        name[0] = 0xE5;
+
+    if (ext_len > 0) {
+        name[len++] = '.';
+        for (i = 0; i < ext_len; i++)
+            name[len++] = (direntry->res & 0x10) ? tolower(direntry->ext[i]) : direntry->ext[i];
+    }
+    name[len] = '\0';
+}
+
+/* UTF-16 long name to UTF-8, stops at the 0x0000 terminator or 0xFFFF padding */
+void vfat_utf16_to_utf8(const uint16_t *in, size_t count, char *out, size_t size)
+{
+    size_t i, len = 0;
+
+    for (i = 0; i < count && in[i] != 0x0000 && in[i] != 0xFFFF; i++) {
+        uint32_t c = in[i];
+
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < count && in[i + 1] >= 0xDC00 && in[i + 1] < 0xE000) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (in[i + 1] - 0xDC00);
+            i++;
+        }
+
+        if (len + 4 >= size)
+            break;
+        if (c < 0x80) {
+            out[len++] = c;
+        } else if (c < 0x800) {
+            out[len++] = 0xC0 | (c >> 6);
+            out[len++] = 0x80 | (c & 0x3F);
+        } else if (c < 0x10000) {
+            out[len++] = 0xE0 | (c >> 12);
+            out[len++] = 0x80 | ((c >> 6) & 0x3F);
+            out[len++] = 0x80 | (c & 0x3F);
+        } else {
+            out[len++] = 0xF0 | (c >> 18);
+            out[len++] = 0x80 | ((c >> 12) & 0x3F);
+            out[len++] = 0x80 | ((c >> 6) & 0x3F);
+            out[len++] = 0x80 | (c & 0x3F);
+        }
+    }
+    out[len] = '\0';
+}
+
+// Long file name being collected in front of its short entry
+struct vfat_lfn {
+    uint16_t name[MAX_NAME_SIZE];
+    int      next;  // sequence number expected next, 0 once complete, -1 if none
+    int      len;   // UTF-16 units held, names of 13*n units have no terminator
+    uint8_t  csum;
+};
+
+static void vfat_lfn_add(struct vfat_lfn *lfn, const struct fat32_direntry_long *direntry_long)
+{
+    int seq = direntry_long->seq & VFAT_LFN_SEQ_MASK;
+    uint16_t *part;
+
+    if (direntry_long->seq & VFAT_LFN_SEQ_START) {
+        lfn->next = seq;
+        lfn->len = seq * 13;
+        lfn->csum = direntry_long->csum;
+    }
+
+    /* Invalid order or checksum, the short name will be used */
+    if (seq == 0 || seq * 13 > MAX_NAME_SIZE || seq != lfn->next || direntry_long->csum != lfn->csum) {
+        lfn->next = -1;
+        return;
+    }
+
+    part = lfn->name + (seq - 1) * 13;
+    memcpy(part, (const char *) direntry_long + offsetof(struct fat32_direntry_long, name1), 5 * 2);
+    memcpy(part + 5, (const char *) direntry_long + offsetof(struct fat32_direntry_long, name2), 6 * 2);
+    memcpy(part + 11, (const char *) direntry_long + offsetof(struct fat32_direntry_long, name3), 2 * 2);
+    for (seq = 0; seq < 13; seq++)
+        part[seq] = le16toh(part[seq]);
+
+    lfn->next--;
 }
 
-int vfat_readdir(uint32_t first_cluster, fuse_fill_dir_t callback, void *callbackdata)
+/**
+ * Lists a directory, calling callback for every entry
+ * @first_cluster first cluster of the directory
+ * @offs cursor to resume from: the index of a 32-byte entry within the
+ *       cluster chain, as handed to callback with the previous entry
+ * @returns 0; stops early when callback returns nonzero
+*/
+int vfat_readdir(uint32_t first_cluster, off_t offs, fuse_fill_dir_t callback, void *callbackdata)
 {
     struct stat st; // we can reuse same stat entry over and over again
-    int i, seq = 0;
-    uint8_t csum = '\0';
-    char *longname = calloc(MAX_NAME_SIZE, sizeof(char));
+    struct vfat_lfn lfn;
+    struct arena_mark mark;
+    char name[MAX_NAME_SIZE * 3 + 1];
+    uint32_t cluster = first_cluster;
+    uint32_t run = 0, after = 0; // clusters left in the current run, and where the chain goes next
+    off_t index = 0;
+    size_t i;
 
     /* vfat file's id */
+    memset(&st, 0, sizeof(st));
     st.st_uid = vfat_info.mount_uid;
     st.st_gid = vfat_info.mount_gid;
     st.st_nlink = 1;
+    lfn.next = -1;
 
-    /* XXX add your code here */
-    struct fat32_direntry direntry;
-    struct fat32_direntry_long direntry_long;
-    int count = 0; char direcory_end = 1; long current_cluster = first_cluster;
+    /* FAT12/16 root: one fixed region instead of a cluster chain */
+    int fixed_root = (first_cluster == 0 && vfat_info.root_dir_entries > 0);
+    size_t per_cluster = fixed_root ? vfat_info.root_dir_entries : vfat_info.direntry_per_cluster;
+    size_t cluster_size = per_cluster * sizeof(struct fat32_direntry);
+
+    /* skip the clusters in front of the cursor */
+    if (!fixed_root) {
+        cluster = vfat_chain_skip(cluster, offs / per_cluster);
+        index = offs - offs % per_cluster;
+    }
+
+    /* given back on return, so listings nested in callback (vfat_walk) do not pile up */
+    arena_save(&mark);
+    struct fat32_direntry *entries = arena_alloc(cluster_size, vfat_info.io_align);
+
+    for (; fixed_root || vfat_cluster_valid(cluster); index += per_cluster) {
+        off_t where = fixed_root ? vfat_info.root_dir_offset : vfat_cluster_offset(cluster);
+        if (vfat_pread(entries, cluster_size, where) != cluster_size)
+            err(1, "read direntry");
 
-    while(current_cluster < 268435448 && direcory_end != 0)
-    {
-        count = 0; // number of directories in current cluster
-        do
-        {
-            long place = vfat_info.cluster_begin_offset + (current_cluster - 2) * vfat_info.sectors_per_cluster * vfat_info.bytes_per_sector + 32 * count;
+        for (i = (offs > index) ? offs - index : 0; i < per_cluster; i++) {
+            struct fat32_direntry *direntry = &entries[i];
 
-            if(pread(vfat_info.fd, &direntry, sizeof(direntry), place) != sizeof(direntry))
-                err(1, "read direntry 2");
+            if (direntry->nameext[0] == 0) // end of directory
+                goto out;
 
+            if ((direntry->nameext[0] & 0xFF) == 0xE5) { // deleted file
+                lfn.next = -1;
+                continue;
+            }
+
+            if (direntry->attr == VFAT_ATTR_LFN) {
+                vfat_lfn_add(&lfn, (struct fat32_direntry_long *) direntry);
+                continue;
+            }
+
+            if (direntry->attr & VFAT_ATTR_INVAL) { // Volume Label
+                lfn.next = -1;
+                continue;
+            }
+
+            if (lfn.next == 0 && lfn.csum == chkSum((unsigned char *) direntry->nameext))
+                vfat_utf16_to_utf8(lfn.name, lfn.len, name, sizeof(name));
             else
-            {
-                if((direntry.nameext[0] & 0xFF) != 0xE5) // not deleted file
-                {
-                    if(direntry.attr == VFAT_ATTR_LFN) // if it is lfn
-                    {
-                        direntry_long = *((struct fat32_direntry_long *)&direntry); // short_entry => long_entry
-                        csum = direntry_long.csum; // save checksum for short_entry
-
-                        if((direntry_long.seq & VFAT_LFN_SEQ_START) == VFAT_LFN_SEQ_START) // End of LFN
-                        {
-
-                            seq = (direntry_long.seq & VFAT_LFN_SEQ_MASK) -1; // ex) 0x41 & VFAT_LFN_SEQ_MASK = 1
-
-                            for(i = 0; i < 13; i++)
-                            {
-                                if(i < 5 && direntry_long.name1[i] != 0xFF) // name1
-                                {
-                                    longname[i] = direntry_long.name1[i];
-                                }
-
-                                else if(i < 11 && direntry_long.name2[i] != 0xFF) // name2
-                                {
-                                    longname[i] = direntry_long.name2[i - 5];
-                                }
-
-                                else if(i < 13 && direntry_long.name3[i] != 0xFF) // name3
-                                {
-                                    longname[i] = direntry_long.name3[i - 11];
-                                }
-                            }
-                        }
-
-                        else if(csum == direntry_long.csum && direntry_long.seq == seq) // seq = 1, 2, 3... not 0x40~~
-                        {
-                            char tmp[MAX_NAME_SIZE];    // add for End of LFN's longname
-                            memset(tmp, 0, MAX_NAME_SIZE);
-
-                            for(i = 0; i < MAX_NAME_SIZE; i++)  // save file name
-                                tmp[i] = longname[i];
-
-                            memset(longname, 0, MAX_NAME_SIZE); // init
-
-                            seq -= 1;   // order - 1
-
-                            for(i = 0; i < MAX_NAME_SIZE; i++)
-                            {
-                                if(i < 5 && direntry_long.name1[i] != 0xFF) // name1
-                                {
-                                    longname[i] = direntry_long.name1[i];
-                                }
-
-                                else if(i < 11 && direntry_long.name2[i] != 0xFF)   // name2
-                                {
-                                    longname[i] = direntry_long.name2[i - 5];
-                                }
-
-                                else if(i < 13 && direntry_long.name3[i] != 0xFF)   // name3
-                                {
-                                    longname[i] = direntry_long.name3[i - 11];
-                                }
-
-                                else if(i >= 13 && tmp[i-13] != 0xFF)   // add before LFN name
-                                {
-                                    longname[i] = tmp[(i-13)];
-                                }
-                            }
-                        }
-
-                        else    // Invalid order or checksum
-                        {
-                            seq = 0;
-                            csum = '\0';
-                            memset(longname, 0, MAX_NAME_SIZE);
-                            err(1, "Invalid sequence or chekcsum\n");
-                        }
-                    }
-                    else if(direntry.attr == 0x08)  // Volume Label
-                    {
-                        seq = 0;
-                        csum = '\0';
-                        memset(longname, 0, MAX_NAME_SIZE);
-                    }
-
-                    else if(csum == chkSum((unsigned char *)&(direntry.nameext)) && seq == 0)   // Short_entry what has long file name
-                    {
-                        st.st_mode = S_IRWXU | S_IRWXG | S_IRWXO;
-
-                        st.st_mode |= ((direntry.attr >> 4) & 1) ? S_IFDIR : S_IFREG;
-
-                        /* size */
-                        st.st_size = direntry.size;
-                        fflush(stdout);
-
-                        struct tm info;
-
-                        /* last accessed data */
-                        info.tm_year = (((direntry.atime_date >> 9) & 0x3F) + 80);
-                        info.tm_mon = ((direntry.atime_date >> 5) & 0xF) - 1;
-                        info.tm_mday = (direntry.atime_date & 0x1F);
-
-                        st.st_atime = (direntry.atime_date > 0) ? mktime(&info) : 0;
-
-                        /* last modified time */
-                        info.tm_year = (((direntry.mtime_date >> 9) & 0x3F) + 80);
-                        info.tm_mon = ((direntry.mtime_date >> 5) & 0xF) - 1;
-                        info.tm_mday = (direntry.mtime_date & 0x1F);
-
-                        info.tm_hour = ((direntry.mtime_time >> 11) & 0x1F) + 1;
-                        info.tm_min = ((direntry.mtime_time >> 5) & 0x3F);
-                        info.tm_sec = 2 * (direntry.mtime_time & 0x1F);
-
-                        st.st_mtime = (direntry.mtime_date > 0) ? mktime(&info) : 0;
-
-                        /* created time */
-                        info.tm_year = (((direntry.ctime_date >> 9) & 0x3F) + 80);
-                        info.tm_mon = ((direntry.ctime_date >> 5) & 0xF) - 1;
-                        info.tm_mday = (direntry.ctime_date & 0x1F);
-
-                        info.tm_hour = ((direntry.ctime_time >> 11) & 0x1F) + 1;
-                        info.tm_min = ((direntry.ctime_time >> 5) & 0x3F);
-                        info.tm_sec = 2 * (direntry.ctime_time & 0x1F);
-
-                        st.st_ctime = (direntry.ctime_date > 0) ? mktime(&info) : 0;
-
-                        st.st_dev = 0;
-                        st.st_blocks = 2;
-                        st.st_blksize = 4;
-                        st.st_ino = direntry.cluster_hi * 256 * 256 + direntry.cluster_lo;
-
-                        /* callback file name */
-                        callback(callbackdata, longname, &st, 0);
-
-                        /* init for next directory */
-                        csum = '\0';
-                        memset(longname, 0, MAX_NAME_SIZE);
-                    }
-
-                    else
-                    {
-                        st.st_mode = S_IRWXU | S_IRWXG | S_IRWXO;
-
-                        st.st_mode |= ((direntry.attr >> 4) & 1) ? S_IFDIR : S_IFREG;
-
-                        /* size */
-                        st.st_size = direntry.size;
-                        fflush(stdout);
-
-                        struct tm info;
-
-                        /* last accessed time */
-                        info.tm_year = (((direntry.atime_date >> 9) & 0x3F) + 80);
-                        info.tm_mon = ((direntry.atime_date >> 5) & 0xF) - 1;
-                        info.tm_mday = (direntry.atime_date & 0x1F);
-
-                        st.st_atime = (direntry.atime_date > 0) ? mktime(&info) : 0;
-
-                        /* last modified time */
-                        info.tm_year = (((direntry.mtime_date >> 9) & 0x3F) + 80);
-                        info.tm_mon = ((direntry.mtime_date >> 5) & 0xF) - 1;
-                        info.tm_mday = (direntry.mtime_date & 0x1F);
-
-                        info.tm_hour = ((direntry.mtime_time >> 11) & 0x1F) + 1;
-                        info.tm_min = ((direntry.mtime_time >> 5) & 0x3F);
-                        info.tm_sec = 2 * (direntry.mtime_time & 0x1F);
-
-                        st.st_mtime = (direntry.mtime_date > 0) ? mktime(&info) : 0;
-
-                        /* Created time */
-                        info.tm_year = (((direntry.ctime_date >> 9) & 0x3F) + 80);
-                        info.tm_mon = ((direntry.ctime_date >> 5) & 0xF) - 1;
-                        info.tm_mday = (direntry.ctime_date & 0x1F);
-
-                        info.tm_hour = ((direntry.ctime_time >> 11) & 0x1F) + 1;
-                        info.tm_min = ((direntry.ctime_time >> 5) & 0x3F);
-                        info.tm_sec = 2 * (direntry.ctime_time & 0x1F);
-
-                        st.st_ctime = (direntry.ctime_date > 0) ? mktime(&info) : 0;
-
-                        st.st_dev = 0;
-                        st.st_blocks = 2;
-                        st.st_blksize = 4;
-                        st.st_ino = direntry.cluster_hi * 256 * 256 + direntry.cluster_lo;
-
-                        /* short file name */
-                        char newname[13] = "ZZZZZZZZZZZ";
-                        char ext_exist = 0; char padding_end = 0;
-
-                        int index = 11;
-                        while(index > 8)
-                        {
-                            if(direntry.nameext[(index-1)] != '\ ')
-                            {
-                                ext_exist = 1;
-                                newname[index] = direntry.nameext[(index - 1)];
-                            }
-                            else
-                                newname[index] = 0;
-                            index--;
-                        }
-
-                        if(ext_exist == 1)
-                        {
-                            newname[index] = '.'; index --;
-                        }
-
-                        while(index > -1)
-                        {
-                            if(direntry.nameext[index] == '\ ' && padding_end == 0)
-                            {
-                                newname[index] = newname[index+1];
-                                newname[index+1] = newname[index+2];
-                                newname[index+2] = newname[index+3];
-                                newname[index+3] = newname[index+4];
-                                newname[index+4] = 0;
-                            }
-
-                            else
-                            {
-                                padding_end = 1;
-                                newname[index] = direntry.nameext[index];
-                            }
-                            index--;
-                        }
-                            
-                        if(callback(callbackdata, newname, &st, 0)){
-                        }
-
-                    }
-                    
-                }
-
-            } count++;
-
-            pread(vfat_info.fd, &direcory_end, sizeof(direcory_end), place);
-        } while(direcory_end != 0 && count < (vfat_info.bytes_per_cluster / (32 * 4)));
-        /* find next cluster */
-        current_cluster = vfat_next_cluster(current_cluster);
+                vfat_short_name(direntry, name);
+            lfn.next = -1;
+
+            vfat_fill_stat(direntry, &st);
+
+            /* the cursor handed out points past this entry */
+            if (callback(callbackdata, name, &st, index + i + 1))
+                goto out;
+        }
+        if (fixed_root)
+            break;
+        /* find next cluster, the FAT is only read at the end of a run */
+        if (run == 0)
+            run = vfat_chain_run(cluster, VFAT_READDIR_RUN, &after);
+        cluster = --run > 0 ? cluster + 1 : after;
     }
-    /* free long file name buffer */
-    free(longname);
-    fflush(stdout);
-    /* XXX End */
+out:
+    arena_release(&mark);
     return 0;
 }
 
@@ -410,50 +596,122 @@ int vfat_search_entry(void *data, const char *name, const struct stat *st, off_t
 */
 int vfat_resolve(const char *path, struct stat *st)
 {
-    /* TODO: Add your code here.
-        You should tokenize the path (by slash separator) and then
-        for each token search the directory for the file/dir with that name.
-        You may find it useful to use following functions:
-        - strtok to tokenize by slash. See manpage
-        - vfat_readdir in conjuction with vfat_search_entry
-    */
-    int res = -ENOENT; // Not Found
-    int debug = 0;
-    long cluster = vfat_info.root_inode.st_ino;
-
-    if (strcmp("/", path) == 0)\
-    {
-        *st = vfat_info.root_inode;
-        res = 0;
+    size_t path_len = strlen(path);
+    char *buf, *name, *save;
+    struct vfat_search_data sd;
+    uint32_t parent;
+
+    *st = vfat_info.root_inode;
+    if (strcmp("/", path) == 0)
+        return 0;
+
+    /* tokenized copy from the request arena */
+    buf = arena_alloc(path_len + 1, 1);
+    memcpy(buf, path, path_len + 1);
+    sd.st = st; // found entries are written straight to the caller
+
+    for (name = strtok_r(buf, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save)) {
+        if (!S_ISDIR(st->st_mode))
+            return -ENOTDIR;
+        parent = st->st_ino;
+
+        /* an earlier listing may already know this entry */
+        if (vfat_cache_lookup(parent, name, st))
+            continue;
+
+        sd.name = name;
+        sd.found = 0;
+        vfat_readdir(parent, 0, vfat_search_entry, &sd);
+        if (!sd.found)
+            return -ENOENT;
+        vfat_cache_insert(parent, name, st);
     }
-    else
-    {
-        struct vfat_search_data sd;
-        struct stat st_test; sd.st = &st_test;
-
-        sd.name = strtok((char *) path, "/");
-
-        while(sd.name != NULL)
-        {
-            sd.found = 0;
-            vfat_readdir(cluster, vfat_search_entry, &sd);
-            if(sd.found == 1)
-            {
-                cluster = sd.st->st_ino;
-                *st = *sd.st;
-                sd.name = strtok(NULL, "/");
-                res = 0; debug++;
-            }
-            else
+
+    return 0;
+}
+
+// Used by vfat_walk()
+struct vfat_walk_data {
+    char*       path;   // PATH_MAX buffer, holds the directory being listed
+    size_t      len;
+    uint32_t*   stack;  // clusters of the directories being listed
+    size_t      depth;
+    vfat_walk_t callback;
+    void*       data;
+    int         stop;
+};
+
+static int vfat_walk_entry(void *data, const char *name, const struct stat *st, off_t offs)
+{
+    struct vfat_walk_data *wd = data;
+    size_t len = wd->len;
+    size_t name_len = strlen(name);
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return 0;
+    if (len + 1 + name_len >= PATH_MAX)
+        return 0;
+
+    wd->path[len] = '/';
+    memcpy(wd->path + len + 1, name, name_len + 1);
+    // the walk reads the entries anyway, later getattrs on them hit
+    vfat_cache_prewarm(wd->stack[wd->depth - 1], name, st);
+
+    if (wd->callback(wd->data, wd->path, st)) {
+        wd->stop = 1;
+    } else if (S_ISDIR(st->st_mode)) {
+        size_t i;
+
+        // a corrupted image can link a directory below itself
+        for (i = 0; i < wd->depth; i++)
+            if (wd->stack[i] == st->st_ino)
                 break;
+        if (i == wd->depth) {
+            wd->stack[wd->depth++] = st->st_ino;
+            wd->len = len + 1 + name_len;
+            vfat_readdir(st->st_ino, 0, vfat_walk_entry, wd);
+            wd->len = len;
+            wd->depth--;
         }
     }
-    return res;
+
+    wd->path[len] = '\0';
+    return wd->stop;
+}
+
+/**
+ * Depth-first walk of the tree below a directory
+ * @path path of the directory, "/" for the root
+ * @cluster its first cluster
+ * @callback called with the full path of every entry except . and ..,
+ *           a nonzero return stops the walk
+*/
+void vfat_walk(const char *path, uint32_t cluster, vfat_walk_t callback, void *data)
+{
+    struct vfat_walk_data wd;
+
+    wd.path = arena_alloc(PATH_MAX, 1);
+    wd.len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+    if (wd.len >= PATH_MAX)
+        return;
+    memcpy(wd.path, path, wd.len);
+    wd.path[wd.len] = '\0';
+    wd.callback = callback;
+    wd.data = data;
+    wd.stop = 0;
+
+    /* every level takes at least two characters of the path */
+    wd.stack = arena_alloc((PATH_MAX / 2 + 1) * sizeof(*wd.stack), sizeof(*wd.stack));
+    wd.stack[0] = cluster;
+    wd.depth = 1;
+
+    vfat_readdir(cluster, 0, vfat_walk_entry, &wd);
 }
 
 // Get file attributes
 int vfat_fuse_getattr(const char *path, struct stat *st)
 {
+    VFAT_REQUEST(SCHED_META);
     if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0) {
         // This is handled by debug virtual filesystem
         return debugfs_fuse_getattr(path + strlen(DEBUGFS_PATH), st);
@@ -467,8 +725,27 @@ int vfat_fuse_getattr(const char *path, struct stat *st)
 int vfat_fuse_getxattr(const char *path, const char* name, char* buf, size_t size)
 {
     struct stat st;
+    // a query walks the whole subtree
+    VFAT_REQUEST(strncmp(name, QUERY_XATTR, strlen(QUERY_XATTR)) == 0 ? SCHED_BULK : SCHED_META);
     int ret = vfat_resolve(path, &st);
     if (ret != 0) return ret;
+
+    // debug.query:<spec> on a directory, see query.h
+    if (strncmp(name, QUERY_XATTR, strlen(QUERY_XATTR)) == 0) {
+        if (!S_ISDIR(st.st_mode)) return -ENODATA;
+        struct query_result *result = query_run(path, st.st_ino, name + strlen(QUERY_XATTR));
+        if (result == NULL) return -EINVAL;
+        ret = result->len;
+        if (buf != NULL) {
+            if (result->len > size)
+                ret = -ERANGE;
+            else
+                memcpy(buf, result->data, result->len);
+        }
+        query_free(result);
+        return ret;
+    }
+
     if (strcmp(name, "debug.cluster") != 0) return -ENODATA;
 
     if (buf == NULL) {
@@ -482,82 +759,162 @@ int vfat_fuse_getxattr(const char *path, const char* name, char* buf, size_t siz
     }
 }
 
+// Resolve the directory once per open, readdir chunks reuse the cluster in fi->fh
+int vfat_fuse_opendir(const char *path, struct fuse_file_info *fi)
+{
+    struct stat st;
+    int ret;
+
+    VFAT_REQUEST(SCHED_META);
+    if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0)
+        return 0;
+
+    ret = vfat_resolve(path, &st);
+    if (ret != 0) return ret;
+    if (!S_ISDIR(st.st_mode)) return -ENOTDIR;
+
+    fi->fh = st.st_ino;
+    return 0;
+}
+
+int vfat_fuse_open(const char *path, struct fuse_file_info *fi)
+{
+    VFAT_REQUEST(vfat_request_class(path));
+    if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0)
+        return debugfs_fuse_open(path + strlen(DEBUGFS_PATH), fi);
+    return 0;
+}
+
+int vfat_fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0)
+        return debugfs_fuse_release(path + strlen(DEBUGFS_PATH), fi);
+    return 0;
+}
+
+// The image is never written, only debugfs accepts input this way
+int vfat_fuse_write(const char *path, const char *buf, size_t size, off_t offs,
+                    struct fuse_file_info *fi)
+{
+    VFAT_REQUEST(SCHED_META); // only appends to the owner batch list
+    if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0)
+        return debugfs_fuse_write(path + strlen(DEBUGFS_PATH), buf, size, offs, fi);
+    return -EROFS;
+}
+
+int vfat_fuse_truncate(const char *path, off_t size)
+{
+    VFAT_REQUEST(SCHED_META);
+    if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0)
+        return debugfs_fuse_truncate(path + strlen(DEBUGFS_PATH), size);
+    return -EROFS;
+}
+
+int vfat_fuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    return vfat_fuse_truncate(path, size);
+}
+
+// Used by vfat_fuse_readdir() to remember attributes of listed entries
+struct vfat_fill_data {
+    uint32_t        cluster;
+    fuse_fill_dir_t callback;
+    void*           callback_data;
+};
+
+int vfat_fill_entry(void *data, const char *name, const struct stat *st, off_t offs)
+{
+    struct vfat_fill_data *fd = data;
+
+    // readdirplus: the getattr following each entry is served from the cache
+    if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+        vfat_cache_insert(fd->cluster, name, st);
+
+    return fd->callback(fd->callback_data, name, st, offs);
+}
+
 int vfat_fuse_readdir(
         const char *path, void *callback_data,
-        fuse_fill_dir_t callback, off_t unused_offs, struct fuse_file_info *unused_fi)
+        fuse_fill_dir_t callback, off_t offs, struct fuse_file_info *fi)
 {
+    VFAT_REQUEST(vfat_request_class(path));
     if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0) {
         // This is handled by debug virtual filesystem
-        return debugfs_fuse_readdir(path + strlen(DEBUGFS_PATH), callback_data, callback, unused_offs, unused_fi);
-    }{
+        return debugfs_fuse_readdir(path + strlen(DEBUGFS_PATH), callback_data, callback, offs, fi);
+    }
+
+    uint32_t cluster;
+
+    if (fi != NULL && fi->fh != 0) {
+        cluster = fi->fh;
+    } else {
         struct stat st;
-        vfat_resolve(path, &st);
-        vfat_readdir(st.st_ino, callback, callback_data);
+        int ret = vfat_resolve(path, &st);
+        if (ret != 0) return ret;
+        if (!S_ISDIR(st.st_mode)) return -ENOTDIR;
+        cluster = st.st_ino;
     }
-    /* TODO: Add your code here. You should reuse vfat_readdir and vfat_resolve functions
-    */
-    return 0;
+
+    struct vfat_fill_data fd = { cluster, callback, callback_data };
+    return vfat_readdir(cluster, offs, vfat_fill_entry, &fd);
 }
 
 int vfat_fuse_read(
         const char *path, char *buf, size_t size, off_t offs,
         struct fuse_file_info *unused)
 {
+    VFAT_REQUEST(strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0 ? vfat_request_class(path) : SCHED_BULK);
     if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0) {
         // This is handled by debug virtual filesystem
         return debugfs_fuse_read(path + strlen(DEBUGFS_PATH), buf, size, offs, unused);
     }
-    /* TODO: Add your code here. Look at debugfs_fuse_read for example interaction.
-    */
-
-    struct stat st; int current = 0; int read_byte = vfat_info.bytes_per_cluster;
 
-    vfat_resolve(path, &st);
-
-    char tmpbuf[size];
-    int len = (int)st.st_size - offs;
-
-    if(len <= 0) return 0;
-    
-    if(len > size)
-        len = size;
+    struct stat st;
+    int ret = vfat_resolve(path, &st);
+    if (ret != 0) return ret;
+    if (S_ISDIR(st.st_mode)) return -EISDIR;
 
-    int where_is = offs; int current_cluster = st.st_ino;
+    if (offs >= st.st_size) return 0;
+    if (size > st.st_size - offs)
+        size = st.st_size - offs;
 
-    while(where_is > vfat_info.bytes_per_cluster)
-    {
-        current_cluster = vfat_next_cluster(current_cluster);
-        where_is -= vfat_info.bytes_per_cluster;
-    } current += where_is;
+    /* walk to the cluster holding offs */
+    uint32_t cluster = vfat_chain_skip(st.st_ino, offs / vfat_info.bytes_per_cluster);
+    off_t skip = offs % vfat_info.bytes_per_cluster;
 
-    long place = 0;
-    while(current < len)
-    {
-        place = vfat_info.cluster_begin_offset + (current_cluster - 2) * vfat_info.sectors_per_cluster * vfat_info.bytes_per_sector;
+    /* read straight into the FUSE buffer, one pread per contiguous run */
+    size_t done = 0;
+    while (done < size && vfat_cluster_valid(cluster)) {
+        off_t where = vfat_cluster_offset(cluster) + skip;
+        uint32_t next, max = (skip + size - done + vfat_info.bytes_per_cluster - 1) / vfat_info.bytes_per_cluster;
 
-        if(pread(vfat_info.fd, tmpbuf, read_byte, place) != read_byte)
-            err(1, "read super block");
+        /* as many physically adjacent clusters as the request still needs */
+        size_t len = (size_t) vfat_chain_run(cluster, max, &next) * vfat_info.bytes_per_cluster - skip;
+        if (len > size - done)
+            len = size - done;
 
-        memcpy(buf + current, tmpbuf, read_byte);
+        if (vfat_pread(buf + done, len, where) != len)
+            err(1, "read clusters at %jd", (intmax_t) where);
 
-        if((len - current) > vfat_info.bytes_per_cluster)
-        {
-            current += vfat_info.bytes_per_cluster;
-            current_cluster = vfat_next_cluster(current_cluster);
-        }
-        else
-        {
-            current += (len - current);
-            read_byte = (len - current);
-        }
+        done += len;
+        skip = 0;
+        cluster = next;
     }
-    return 0;
+    return done;
 }
 
 ////////////// No need to modify anything below this point
 int
 vfat_opt_args(void *data, const char *arg, int key, struct fuse_args *oargs)
 {
+    if (key == VFAT_KEY_PREWARM) {
+        vfat_info.prewarm = 1;
+        return (0);
+    }
+    if (key == VFAT_KEY_ODIRECT) {
+        vfat_info.odirect = 1;
+        return (0);
+    }
     if (key == FUSE_OPT_KEY_NONOPT && !vfat_info.dev) {
         vfat_info.dev = strdup(arg);
         return (0);
@@ -565,18 +922,33 @@ vfat_opt_args(void *data, const char *arg, int key, struct fuse_args *oargs)
     return (1);
 }
 
+// Runs once fuse has daemonized, so it is safe to start threads here
+void *vfat_fuse_init(struct fuse_conn_info *conn)
+{
+    if (vfat_info.prewarm)
+        crawler_start(CRAWLER_THREADS);
+    return NULL;
+}
+
 struct fuse_operations vfat_available_ops = {
+    .init = vfat_fuse_init,
     .getattr = vfat_fuse_getattr,
     .getxattr = vfat_fuse_getxattr,
+    .open = vfat_fuse_open,
+    .release = vfat_fuse_release,
+    .opendir = vfat_fuse_opendir,
     .readdir = vfat_fuse_readdir,
     .read = vfat_fuse_read,
+    .write = vfat_fuse_write,
+    .truncate = vfat_fuse_truncate,
+    .ftruncate = vfat_fuse_ftruncate,
 };
 
 int main(int argc, char **argv)
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-    fuse_opt_parse(&args, NULL, NULL, vfat_opt_args);
+    fuse_opt_parse(&args, NULL, vfat_opts, vfat_opt_args);
 
     if (!vfat_info.dev)
         errx(1, "missing file system parameter");
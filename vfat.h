@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fuse.h>
 
 // Boot sector
 struct fat_boot_header {
@@ -106,16 +107,37 @@ struct vfat_data {
     size_t      cluster_size;
     off_t       fat_begin_offset;
     size_t      fat_size;
+    int         fat_bits;           // 12, 16 or 32
+    off_t       root_dir_offset;    // FAT12/16 fixed root directory
+    size_t      root_dir_entries;   // 0 on FAT32, whose root is a cluster chain
     struct stat root_inode;
+    int         prewarm; // -o prewarm: crawl the tree in the background
+    int         odirect; // -o odirect: read the image with O_DIRECT
+    size_t      io_align; // buffer/offset alignment for O_DIRECT reads
     uint32_t*   fat; // use util::mmap_file() to map this directly into the memory 
 };
 
 struct vfat_data vfat_info;
 
 /// FOR debugfs
-int vfat_next_cluster(unsigned int c);
+uint32_t vfat_next_cluster(uint32_t c);
+uint32_t vfat_chain_skip(uint32_t c, uint32_t n);
+uint32_t vfat_chain_run(uint32_t c, uint32_t max, uint32_t *next);
 int vfat_resolve(const char *path, struct stat *st);
 int vfat_fuse_getattr(const char *path, struct stat *st);
 ///
 
+int vfat_cluster_valid(uint32_t c);
+off_t vfat_cluster_offset(uint32_t c);
+ssize_t vfat_pread(void *buf, size_t size, off_t offs);
+int vfat_direct_open(size_t *align);
+unsigned char chkSum(unsigned char *pFcbName);
+void vfat_short_name(const struct fat32_direntry *direntry, char *name);
+void vfat_utf16_to_utf8(const uint16_t *in, size_t count, char *out, size_t size);
+int vfat_readdir(uint32_t first_cluster, off_t offs, fuse_fill_dir_t callback, void *callbackdata);
+int vfat_foreground_pending(void);
+
+typedef int (*vfat_walk_t)(void *data, const char *path, const struct stat *st);
+void vfat_walk(const char *path, uint32_t cluster, vfat_walk_t callback, void *data);
+
 #endif